@@ -1,6 +1,7 @@
 #include <string.h>
 #include <avr/io.h>
-#include <util/delay.h>
+#include <avr/pgmspace.h>
+#include <util/crc16.h>
 
 #include "uuart.h"
 #include "icsp.h"
@@ -9,7 +10,65 @@
 
 
 unsigned char input_buffer[INPUT_BUFFER_SIZE];
-int recv_size;
+unsigned char recv_size;
+
+// Replies used all over. Strings stay in flash, there is no room for them
+// in SRAM next to the input buffer.
+static const char str_ok[] PROGMEM = SERIAL_CMD_OK;
+static const char str_error[] PROGMEM = SERIAL_CMD_ERROR;
+
+// Programming session, kept across host disconnects so an interrupted
+// image can be resumed. Counts the rows written since the session began
+// and runs a CRC over their address and data. Stops counting at the first
+// row that fails, so the count is always a contiguous run of rows, until
+// a host asks where it got to and carries on from there. The CRC before
+// the last row is kept too: if another host took over mid-row before the
+// receive timed out, the rest of that row was made up of whatever it sent.
+// Only the last row can be dropped that way, once.
+static struct {
+    unsigned int token;
+    unsigned int rows;
+    unsigned int crc;
+    unsigned int last_crc;
+    unsigned char active : 1;
+    unsigned char droppable : 1;
+} session;
+
+// Sequence numbers of the most recent ROW frames written, frame_last and
+// the 15 before it as a bit mask, so a frame the host sends again because
+// it missed the reply is not written twice.
+static unsigned char frame_last;
+static unsigned int frame_mask;
+
+// Words read ahead for READ. While valid, the PIC's address is at
+// next + count, so a READ of next needs no address load. Once two READs
+// in a row were sequential, the following words are read ahead between
+// commands and a READ of next is answered from the cache.
+static struct {
+    unsigned int next;
+    unsigned char first : READ_CACHE_BITS;
+    unsigned char count : READ_CACHE_BITS + 1;
+    unsigned char valid : 1;
+    unsigned char sequential : 1;
+} read_cache;
+
+// The cached words live at the end of input_buffer, high byte first. A
+// READ only uses the start of it, anything else clears the cache first.
+#define read_cache_word(i) \
+    (input_buffer + INPUT_BUFFER_SIZE - 2 * READ_CACHE_SIZE + 2 * (i))
+
+#if ROW_WRITE_BEHIND
+// The last streamed ROW, answered while its last write was still running.
+// It is read back before the PIC is used for anything else, and compared
+// against the CRC of what was sent.
+static struct {
+    unsigned int address;
+    unsigned int crc;
+    unsigned char pending : 1;
+    unsigned char failed : 1;
+    unsigned char counted : 1;
+} behind;
+#endif
 
 
 // Status Flags
@@ -17,23 +76,31 @@ int recv_size;
 #define STATUS_CONNECTED 1
 #define STATUS_PROGRAM 2
 
-unsigned char cmd_is(const char *cmd)
+unsigned char cmd_is(PGM_P cmd)
 {
-    if (memcmp(input_buffer, cmd, strlen(cmd)) == 0) {
+    if (memcmp_P(input_buffer, cmd, strlen_P(cmd)) == 0) {
         return 1;
     }
     return 0;
 }
 
-void cmd_resp(const char *resp)
+void cmd_resp(PGM_P resp)
 {
-    uuart_print((char *)resp);
+    uuart_print_P(resp);
     uuart_tx_byte(SERIAL_CMD_SEP);
 }
 
 void cmd_resp_error(unsigned char *msg, unsigned char msg_len)
 {
-    uuart_print(SERIAL_CMD_ERROR);
+    // A command cut short by a receive timeout is dropped with whatever
+    // came of it, so the next byte starts a new command.
+    if (uuart_rx_timeout()) {
+        uuart_flush_buffers();
+        cmd_resp(PSTR(SERIAL_CMD_TIMEOUT));
+        return;
+    }
+
+    uuart_print_P(str_error);
     uuart_tx_byte(SERIAL_CMD_SEP);
 
     for (int i=0; i < msg_len; i++)
@@ -44,74 +111,411 @@ void cmd_resp_error(unsigned char *msg, unsigned char msg_len)
 
 unsigned char cmd_hello(void)
 {
-    cmd_resp(SERIAL_CMD_HELLO);
+    cmd_resp(PSTR(SERIAL_CMD_HELLO));
     return STATUS_CONNECTED;
 }
 
 unsigned char cmd_bye(void)
 {
-    cmd_resp(SERIAL_CMD_BYE);
+    cmd_resp(PSTR(SERIAL_CMD_BYE));
     return STATUS_DISCONNECTED;
 }
 
+/* PIC programming sequences shared by the commands below. */
+
+static void pic_load_address(unsigned int address)
+{
+    icsp_command(ICSP_CMD_ADDR_LOAD);
+    icsp_delay_us(icsp_timing.dly);
+    icsp_payload(address);
+    icsp_delay_us(icsp_timing.dly);
+}
+
+static void pic_load_data(unsigned char cmd, unsigned int word)
+{
+    icsp_command(cmd);
+    icsp_delay_us(icsp_timing.dly);
+    icsp_payload(word);
+    icsp_delay_us(icsp_timing.dly);
+}
+
+static unsigned int pic_read_word(unsigned char cmd)
+{
+    icsp_command(cmd);
+    icsp_delay_us(icsp_timing.dly);
+    unsigned int word = icsp_read();
+    icsp_delay_us(icsp_timing.dly);
+    return word;
+}
+
+static void pic_start_write(unsigned int us)
+{
+    // Begin write command. It is timed internally by the PIC, the next
+    // command waits for it.
+    icsp_command(ICSP_CMD_START_INT);
+    icsp_busy(us);
+}
+
+static void pic_write_word(unsigned int address, unsigned int word)
+{
+    pic_load_address(address);
+    pic_load_data(ICSP_CMD_LOAD_DATA, word);
+    pic_start_write(icsp_timing.pint_cw);
+}
+
+static unsigned char pic_row_last(unsigned int address, unsigned char index)
+{
+    // Whether word index of the ROW at address is the last one loaded
+    // into the PIC's write latches before they are written.
+    return index == SERIAL_ROW_WORDS - 1 || !((address + index + 1) & (ICSP_ROW_WORDS - 1));
+}
+
+static void pic_row_word(unsigned int address, unsigned char index, unsigned int word)
+{
+    // Load word index of the ROW at address. The PIC writes ICSP_ROW_WORDS
+    // at a time, to the row its address is in, so the last word of each of
+    // its rows is loaded without incrementing and written, and the address
+    // only moves on to the next row once that write is done.
+    unsigned char last = pic_row_last(address, index);
+    address += index;
+    if (index == 0) {
+        pic_load_address(address);
+    }
+    else if (!(address & (ICSP_ROW_WORDS - 1))) {
+        icsp_command(ICSP_CMD_ADDR_INC);
+        icsp_delay_us(icsp_timing.dly);
+    }
+
+    if (last) {
+        pic_load_data(ICSP_CMD_LOAD_DATA, word);
+        pic_start_write(icsp_timing.pint_pm);
+    }
+    else {
+        pic_load_data(ICSP_CMD_LOAD_DATA_INC, word);
+    }
+}
+
+static void pic_write_row(unsigned int address, unsigned char *row)
+{
+    unsigned char i;
+    for (i=0; i < SERIAL_ROW_WORDS; i++) {
+        pic_row_word(address, i, (row[2*i] << 8) | row[2*i+1]);
+    }
+}
+
+static void pic_erase_row(unsigned int address)
+{
+    unsigned char cmd = ICSP_CMD_ERASE_ROW;
+
+    // Bulk erase the whole device
+    if (address == SERIAL_CMD_ERASE_ALL) {
+        address = 0x8000;
+        cmd = ICSP_CMD_ERASE_BULK;
+    }
+    // Bulk erase user flash
+    else if (address == SERIAL_CMD_ERASE_FLASH) {
+        address = 0x0000;
+        cmd = ICSP_CMD_ERASE_BULK;
+    }
+
+    pic_load_address(address);
+    icsp_command(cmd);
+    if (cmd == ICSP_CMD_ERASE_BULK)
+    {
+        icsp_busy(icsp_timing.erab);
+    }
+    else
+    {
+        icsp_busy(icsp_timing.erar);
+    }
+}
+
+static void session_reset(void)
+{
+    session.rows = 0;
+    session.crc = SERIAL_SESSION_CRC_INIT;
+    session.last_crc = SERIAL_SESSION_CRC_INIT;
+    session.droppable = 0;
+}
+
+static void session_drop(void)
+{
+    // Forget the row counted last, its CRC was kept for that.
+    session.rows--;
+    session.crc = session.last_crc;
+    session.droppable = 0;
+}
+
+static void pic_erase(unsigned int address)
+{
+    // What ERASE does: one of the PIC's rows, or a bulk erase, which takes
+    // everything the session wrote with it.
+    pic_erase_row(address);
+    if (address >= SERIAL_CMD_ERASE_FLASH)
+        session_reset();
+}
+
+static void pic_erase_span(unsigned int address)
+{
+    // Erase every one of the PIC's rows a ROW at address spans.
+    unsigned char offset;
+    pic_erase(address);
+    if (address < SERIAL_CMD_ERASE_FLASH) {
+        for (offset=ICSP_ROW_WORDS; offset < SERIAL_ROW_WORDS; offset += ICSP_ROW_WORDS)
+            pic_erase_row(address + offset);
+    }
+}
+
+static unsigned int crc_bytes(unsigned int crc, unsigned char *buf, unsigned char len)
+{
+    unsigned char i;
+    for (i=0; i < len; i++) {
+        crc = _crc_ccitt_update(crc, buf[i]);
+    }
+    return crc;
+}
+
+static void session_count_row(unsigned char *address, unsigned char *row)
+{
+    // Count the row at address, both high byte first.
+    if (session.active) {
+        session.last_crc = session.crc;
+        session.crc = crc_bytes(session.crc, address, 2);
+        session.crc = crc_bytes(session.crc, row, 128);
+        session.rows++;
+        session.droppable = 1;
+    }
+}
+
+#if ROW_WRITE_BEHIND
+static unsigned int crc_word(unsigned int crc, unsigned int word)
+{
+    crc = _crc_ccitt_update(crc, word >> 8);
+    return _crc_ccitt_update(crc, word & 0xFF);
+}
+
+static void behind_start(unsigned int address)
+{
+    // The row in input_buffer was answered before its last write is done.
+    // Expect it back as the PIC reads it, 14 bits a word.
+    unsigned char i;
+    behind.crc = ROW_CHECK_CRC_INIT;
+    for (i=3; i < 131; i += 2)
+        behind.crc = crc_word(behind.crc, ((input_buffer[i] << 8) | input_buffer[i+1]) & ICSP_WORD_MASK);
+    behind.address = address;
+    behind.counted = session.active;
+    behind.pending = 1;
+}
+
+static unsigned int behind_read(unsigned char index, unsigned int crc)
+{
+    // Read back word index of the row written behind, crc being over the
+    // words before it. A row that doesn't come back isn't counted in the
+    // session either, and the session stops counting there.
+    if (index == 0)
+        pic_load_address(behind.address);
+    crc = crc_word(crc, pic_read_word(ICSP_CMD_READ_DATA_INC));
+    if (index == SERIAL_ROW_WORDS - 1) {
+        behind.pending = 0;
+        if (crc != behind.crc) {
+            behind.failed = 1;
+            if (behind.counted && session.droppable)
+                session_drop();
+            session.active = 0;
+        }
+    }
+    return crc;
+}
+
+static unsigned char pic_stream_row(unsigned int address)
+{
+    // Shift each word of the row at address into the PIC's write latches as
+    // soon as it is in, so the write starts right after the last byte and
+    // runs while the next command comes in. The latches are the second row
+    // buffer we have no SRAM for. While the PIC is still busy with a write
+    // or an erase the bytes pile up in input_buffer from the fourth on,
+    // where the session wants them anyway. The word that starts the first
+    // write is held back until the whole row is in, so a row cut short by
+    // a receive timeout writes nothing and 0 is returned; the next row
+    // loads over what made it into the latches.
+    // The row written behind before this one is read back first, between
+    // bytes the same way. If it failed, this one is received but not
+    // written.
+    unsigned char in = 3, out = 3;
+    unsigned char held;
+    unsigned char check = behind.pending ? 0 : SERIAL_ROW_WORDS;
+    unsigned int crc = ROW_CHECK_CRC_INIT;
+    while (out < 131) {
+        held = in < 131 && pic_row_last(address, (out - 3) >> 1);
+        if (in < 131 && (in < out + 2 || held || uuart_rx_data_available())) {
+            input_buffer[in++] = uuart_rx_byte();
+            if (uuart_rx_timeout())
+                return 0;
+        } else if (icsp_ready()) {
+            if (check < SERIAL_ROW_WORDS) {
+                crc = behind_read(check++, crc);
+                continue;
+            }
+            if (!behind.failed)
+                pic_row_word(address, (out - 3) >> 1, (input_buffer[out] << 8) | input_buffer[out+1]);
+            out += 2;
+        }
+    }
+    return 1;
+}
+
+#endif
+
+static unsigned char pic_behind_ok(void)
+{
+    // Read back the row written behind the last reply, if there is one,
+    // before anything else uses the PIC. 0 once if it failed, for the
+    // command to answer ERROR in place of carrying on.
+#if ROW_WRITE_BEHIND
+    unsigned char i;
+    unsigned int crc = ROW_CHECK_CRC_INIT;
+    if (behind.pending) {
+        for (i=0; i < SERIAL_ROW_WORDS; i++)
+            crc = behind_read(i, crc);
+    }
+    if (behind.failed) {
+        behind.failed = 0;
+        return 0;
+    }
+#endif
+    return 1;
+}
+
+static void write_buffered_row(void)
+{
+    pic_write_row((input_buffer[0] << 8) | input_buffer[1], input_buffer + 3);
+    session_count_row(input_buffer, input_buffer + 3);
+}
+
+static unsigned char frame_seen(unsigned char seq)
+{
+    unsigned char age = frame_last - seq;
+    return age < 16 && (frame_mask >> age) & 1;
+}
+
+static void frame_accept(unsigned char seq)
+{
+    unsigned char ahead = seq - frame_last;
+    if (ahead < 128) {
+        frame_mask = (ahead < 16) ? frame_mask << ahead : 0;
+        frame_mask |= 1;
+        frame_last = seq;
+    }
+    else if ((unsigned char)-ahead < 16) {
+        frame_mask |= 1 << (unsigned char)-ahead;
+    }
+}
+
+static unsigned char pic_test_row(unsigned int address)
+{
+    // Erase the row, write a pattern that toggles every bit between
+    // neighbouring words, and read it back.
+    unsigned char offset;
+    for (offset=0; offset < 128; offset += 2) {
+        input_buffer[offset] = (offset & 2) ? 0x15 : 0x2A;
+        input_buffer[offset+1] = (offset & 2) ? 0x55 : 0xAA;
+    }
+
+    pic_erase_span(address);
+    pic_write_row(address, input_buffer);
+
+    pic_load_address(address);
+    for (offset=0; offset < 128; offset += 2) {
+        if (pic_read_word(ICSP_CMD_READ_DATA_INC) !=
+            ((input_buffer[offset] << 8) | input_buffer[offset+1]))
+            return 0;
+    }
+    return 1;
+}
+
+static void pic_calibrate(unsigned char *period, unsigned char min, unsigned int address)
+{
+    // Shorten the period one step at a time, down to the datasheet minimum,
+    // until the test row fails, then settle on the shortest good period
+    // plus a safety margin.
+    unsigned char start = *period;
+    unsigned char good = start;
+
+    while (*period > min) {
+        (*period)--;
+        if (!pic_test_row(address)) {
+            // The chip may have lost track of the bit stream, restart
+            // programming mode to get it back in sync. The key has to go
+            // out with a period that works.
+            *period = good;
+            icsp_disable();
+            icsp_enable();
+            break;
+        }
+        good = *period;
+    }
+
+    good += ICSP_CAL_MARGIN;
+    *period = (good > start) ? start : good;
+}
+
+
 unsigned char cmd_start(void)
 {
+    // Whoever starts programming numbers their frames afresh, don't skip
+    // them as ones we have already written.
+    frame_last = 0;
+    frame_mask = 0;
+
     icsp_enable();
-    cmd_resp(SERIAL_CMD_OK);
+    cmd_resp(str_ok);
     return STATUS_PROGRAM;
 }
 
 unsigned char cmd_stop(void)
 {
+    // The row written behind has to be read back while we still can.
+    unsigned char ok = pic_behind_ok();
     icsp_disable();
-    cmd_resp(SERIAL_CMD_OK);
+    if (!ok) {
+        cmd_resp_error(input_buffer, 0);
+        return STATUS_CONNECTED;
+    }
+    cmd_resp(str_ok);
     return STATUS_CONNECTED;
 }
 
 unsigned char cmd_addr(void)
 {
-    uuart_rx_bytes(input_buffer, 2);
+    recv_size = uuart_rx_bytes(input_buffer, 2);
+    if (recv_size != 2) {
+        cmd_resp_error(input_buffer, recv_size);
+        return STATUS_PROGRAM;
+    }
     unsigned int address = (input_buffer[0] << 8) | input_buffer[1];
     icsp_command(ICSP_CMD_ADDR_LOAD);
-    _delay_us(ICSP_DELAY_DLY);
+    icsp_delay_us(icsp_timing.dly);
     icsp_payload(address);
-    cmd_resp(SERIAL_CMD_OK);
+    cmd_resp(str_ok);
     return STATUS_PROGRAM;
 }
 
 unsigned char cmd_word(void)
 {
-    uuart_rx_bytes(input_buffer, 5);
-    if (input_buffer[2] != ':') {
-        cmd_resp_error(input_buffer, 5);
+    recv_size = uuart_rx_bytes(input_buffer, 5);
+    if ((recv_size != 5) || (input_buffer[2] != ':') || !pic_behind_ok()) {
+        cmd_resp_error(input_buffer, recv_size);
         return STATUS_PROGRAM;
     }
     unsigned int address = (input_buffer[0] << 8) | input_buffer[1];
     unsigned int word = (input_buffer[3] << 8) | input_buffer[4];
 
-    // Load address
-    icsp_command(ICSP_CMD_ADDR_LOAD);
-    _delay_us(ICSP_DELAY_DLY);
-    icsp_payload(address);
-    _delay_us(ICSP_DELAY_DLY);
-
-    // Write word
-    icsp_command(ICSP_CMD_LOAD_DATA);
-    _delay_us(ICSP_DELAY_DLY);
-    icsp_payload(word);
-    _delay_us(ICSP_DELAY_DLY);
-
-    // Begin write command
-    icsp_command(ICSP_CMD_START_INT);
-
-    // Wait at least half of the time required for internal timed programming.
-    // The time it takes to respond and such should cover the other half
-    _delay_us(ICSP_DELAY_PINT_CW/2);
+    pic_write_word(address, word);
 
     // verify data
 
     // Return response
-    cmd_resp(SERIAL_CMD_OK);
+    cmd_resp(str_ok);
 
     return STATUS_PROGRAM;
 }
@@ -121,158 +525,529 @@ unsigned char cmd_row(void)
     // Get address
     recv_size = uuart_rx_bytes(input_buffer, 3);
     if ((recv_size != 3) || (input_buffer[2] != ':')) {
+        session.active = 0;
         cmd_resp_error(input_buffer, recv_size);
         return STATUS_PROGRAM;
     }
+
+#if ROW_WRITE_BEHIND
     unsigned int address = (input_buffer[0] << 8) | input_buffer[1];
-    
+    if (!pic_stream_row(address)) {
+        session.active = 0;
+        cmd_resp_error(input_buffer, 0);
+        return STATUS_PROGRAM;
+    }
+    if (!pic_behind_ok()) {
+        cmd_resp_error(input_buffer, 3);
+        return STATUS_PROGRAM;
+    }
+    session_count_row(input_buffer, input_buffer + 3);
+    behind_start(address);
+#else
     // Get row
-    recv_size = uuart_rx_bytes(input_buffer, 128);
+    recv_size = uuart_rx_bytes(input_buffer + 3, 128);
     if (recv_size != 128) {
-        cmd_resp_error(input_buffer, recv_size);
+        session.active = 0;
+        cmd_resp_error(input_buffer + 3, recv_size);
         return STATUS_PROGRAM;
     }
 
-    // Load address
-    icsp_command(ICSP_CMD_ADDR_LOAD);
-    _delay_us(ICSP_DELAY_DLY);
-    icsp_payload(address);
-    _delay_us(ICSP_DELAY_DLY);
-
-    // Write 63 words of data
-    unsigned int word;
-    unsigned char offset;
-    for (offset=0; offset < 126; offset += 2) {
-        // Write word
-        word = (input_buffer[offset] << 8) | input_buffer[offset+1];
-        icsp_command(ICSP_CMD_LOAD_DATA_INC);
-        _delay_us(ICSP_DELAY_DLY);
-        icsp_payload(word);
-        _delay_us(ICSP_DELAY_DLY);
-    }
-
-    //Write 64th word without incrementing address
-    word = (input_buffer[offset] << 8) | input_buffer[offset+1];
-    icsp_command(ICSP_CMD_LOAD_DATA);
-    _delay_us(ICSP_DELAY_DLY);
-    icsp_payload(word);
-    _delay_us(ICSP_DELAY_DLY);
-
-    // Begin write command
-    icsp_command(ICSP_CMD_START_INT);
-    
-    // Hope our serial transfer takes longer than 4ms. (Usually does)
-    // _delay_us(ICSP_DELAY_PINT_PM);
+    write_buffered_row();
+#endif
 
     // verify data
 
     // Return response
-    cmd_resp(SERIAL_CMD_OK);
+    cmd_resp(str_ok);
 
     return STATUS_PROGRAM;
 }
 
-unsigned char cmd_erase(void)
+unsigned char cmd_frow(void)
 {
-    recv_size = uuart_rx_bytes(input_buffer, 2);
-    if (recv_size != 2) {
-        cmd_resp_error(input_buffer, recv_size);
+    // A ROW in a frame: <address> <seq> <128 data bytes> <crc>, the CRC
+    // over everything before it. A damaged frame is NAKed with its
+    // sequence number for the host to send again.
+    recv_size = uuart_rx_bytes(input_buffer, SERIAL_FRAME_SIZE);
+    if (recv_size != SERIAL_FRAME_SIZE) {
+        session.active = 0;
+        cmd_resp_error(input_buffer, 0);
+        return STATUS_PROGRAM;
     }
+    unsigned char seq = input_buffer[2];
+    unsigned int crc = (input_buffer[SERIAL_FRAME_SIZE-2] << 8) | input_buffer[SERIAL_FRAME_SIZE-1];
 
-    unsigned int address = (input_buffer[0] << 8) | input_buffer[1];
-    unsigned char cmd = ICSP_CMD_ERASE_ROW;
-    unsigned int delay_len = ICSP_DELAY_ERAR;
-
-    // Bulk erase the whole device
-    if (address == SERIAL_CMD_ERASE_ALL) {
-        address = 0x8000;
-        cmd = ICSP_CMD_ERASE_BULK;
-        delay_len = ICSP_DELAY_ERAB;
-        
+    if (crc_bytes(SERIAL_FRAME_CRC_INIT, input_buffer, SERIAL_FRAME_SIZE-2) != crc) {
+        cmd_resp(PSTR(SERIAL_CMD_NAK));
+        uuart_tx_byte(seq);
+        return STATUS_PROGRAM;
     }
-    // Bulk erase user flash
-    else if (address == SERIAL_CMD_ERASE_FLASH) {
-        address = 0x0000;
-        cmd = ICSP_CMD_ERASE_BULK;
-        delay_len = ICSP_DELAY_ERAB;
+
+    if (!pic_behind_ok()) {
+        cmd_resp_error(&seq, 1);
+        return STATUS_PROGRAM;
     }
 
-    icsp_command(ICSP_CMD_ADDR_LOAD);
-    _delay_us(ICSP_DELAY_DLY);
-    icsp_payload(address);
-    _delay_us(ICSP_DELAY_DLY);
-    icsp_command(cmd);
-    if (delay_len == ICSP_DELAY_ERAB)
-    {
-        _delay_us(ICSP_DELAY_ERAB);
+    if (!frame_seen(seq)) {
+        write_buffered_row();
+        frame_accept(seq);
     }
-    else
-    {
-        _delay_us(ICSP_DELAY_ERAR);
+
+    cmd_resp(str_ok);
+    uuart_tx_byte(seq);
+    return STATUS_PROGRAM;
+}
+
+unsigned char cmd_erase(void)
+{
+    recv_size = uuart_rx_bytes(input_buffer, 2);
+    if (recv_size != 2 || !pic_behind_ok()) {
+        cmd_resp_error(input_buffer, recv_size);
+        return STATUS_PROGRAM;
     }
 
-    cmd_resp(SERIAL_CMD_OK);
+    pic_erase((input_buffer[0] << 8) | input_buffer[1]);
+    cmd_resp(str_ok);
     return STATUS_PROGRAM;
 }
 
 unsigned char cmd_read(void)
 {
     recv_size = uuart_rx_bytes(input_buffer, 2);
-    if (recv_size != 2) {
+    if (recv_size != 2 || !pic_behind_ok()) {
+        read_cache.valid = 0;
+        read_cache.count = 0;
         cmd_resp_error(input_buffer, recv_size);
+        return STATUS_PROGRAM;
     }
 
     unsigned int address = (input_buffer[0] << 8) | input_buffer[1];
+    unsigned int word;
+    unsigned char sequential = read_cache.valid && address == read_cache.next;
 
-    icsp_command(ICSP_CMD_ADDR_LOAD);
-    _delay_us(ICSP_DELAY_DLY);
-    icsp_payload(address);
-    _delay_us(ICSP_DELAY_DLY);
-    icsp_command(ICSP_CMD_READ_DATA);
-    _delay_us(ICSP_DELAY_DLY);
-    unsigned int word = icsp_read();
+    if (sequential && read_cache.count) {
+        unsigned char *cached = read_cache_word(read_cache.first);
+        word = (cached[0] << 8) | cached[1];
+        read_cache.first = (read_cache.first + 1) & (READ_CACHE_SIZE - 1);
+        read_cache.count--;
+    }
+    else {
+        if (!sequential)
+            pic_load_address(address);
+        word = pic_read_word(ICSP_CMD_READ_DATA_INC);
+        read_cache.first = 0;
+        read_cache.count = 0;
+    }
+    read_cache.next = address + 1;
+    read_cache.valid = 1;
+    read_cache.sequential = sequential;
 
     // Return response
-    cmd_resp(SERIAL_CMD_OK);
+    cmd_resp(str_ok);
     uuart_tx_byte((word >> 8));
     uuart_tx_byte(word & 0xFF);
     return STATUS_PROGRAM;
 }
 
+static unsigned char batch_op_size(unsigned char op)
+{
+    // Bytes in an operation, with its opcode and argument. 0 if unknown.
+    switch (op) {
+    case SERIAL_BATCH_ADDR:
+    case SERIAL_BATCH_ERASE:
+    case SERIAL_BATCH_VERIFY:
+        return 3;
+    case SERIAL_BATCH_WORD:
+        return 5;
+    case SERIAL_BATCH_ROW:
+        return 3 + 2 * SERIAL_ROW_WORDS;
+    }
+    return 0;
+}
+
+unsigned char cmd_batch(void)
+{
+    // A batch is a 16 bit length followed by that many bytes of operations,
+    // each an opcode byte, a 16 bit argument and its data. The whole batch
+    // is received into input_buffer before any of it runs: the link is
+    // half-duplex and erases and writes outlast the RX ring, so nothing can
+    // be taken in while they run. It costs one round trip however many
+    // operations it holds, and a batch that is cut short or can't be framed
+    // runs none of them. Stops at the first verify that fails.
+    recv_size = uuart_rx_bytes(input_buffer, 2);
+    if (recv_size != 2) {
+        cmd_resp_error(input_buffer, recv_size);
+        return STATUS_PROGRAM;
+    }
+    unsigned int length = (input_buffer[0] << 8) | input_buffer[1];
+    unsigned char pos;
+    unsigned char index;
+    unsigned char op;
+    unsigned char size;
+    unsigned int arg;
+
+    if (length > SERIAL_BATCH_MAX) {
+        // Too long to hold. Drop it, as far as the host sends it, so none
+        // of it is taken for commands.
+        for (; length; length--) {
+            uuart_rx_byte();
+            if (uuart_rx_timeout())
+                break;
+        }
+        index = 0;
+        cmd_resp_error(&index, 1);
+        return STATUS_PROGRAM;
+    }
+
+    recv_size = uuart_rx_bytes(input_buffer, length);
+    if (recv_size != length) {
+        cmd_resp_error(input_buffer, 0);
+        return STATUS_PROGRAM;
+    }
+
+    index = 0;
+    if (!pic_behind_ok()) {
+        cmd_resp_error(&index, 1);
+        return STATUS_PROGRAM;
+    }
+
+    for (pos=0, index=0; pos < length; pos += size, index++) {
+        size = batch_op_size(input_buffer[pos]);
+        if (!size || size > length - pos) {
+            cmd_resp_error(&index, 1);
+            return STATUS_PROGRAM;
+        }
+    }
+
+    for (pos=0, index=0; pos < length; pos += batch_op_size(op), index++) {
+        op = input_buffer[pos];
+        arg = (input_buffer[pos+1] << 8) | input_buffer[pos+2];
+
+        switch (op) {
+        case SERIAL_BATCH_ADDR:
+            pic_load_address(arg);
+            break;
+
+        case SERIAL_BATCH_ERASE:
+            pic_erase(arg);
+            break;
+
+        case SERIAL_BATCH_WORD:
+            pic_write_word(arg, (input_buffer[pos+3] << 8) | input_buffer[pos+4]);
+            break;
+
+        case SERIAL_BATCH_ROW:
+            // Counted in the session like any other row.
+            pic_write_row(arg, input_buffer + pos + 3);
+            session_count_row(input_buffer + pos + 1, input_buffer + pos + 3);
+            break;
+
+        case SERIAL_BATCH_VERIFY:
+            // Compare the word at the current address against the expected
+            // word in the argument, then increment the address.
+            if (pic_read_word(ICSP_CMD_READ_DATA_INC) != arg) {
+                cmd_resp_error(&index, 1);
+                return STATUS_PROGRAM;
+            }
+            break;
+        }
+    }
+
+    cmd_resp(str_ok);
+    uuart_tx_byte(index);
+    return STATUS_PROGRAM;
+}
+
+
+static void dump_flush(unsigned int word, unsigned char run)
+{
+    // Blank words are a single run byte, anything else is sent as a literal
+    // followed by a run byte for its repeats.
+    if (word == SERIAL_DUMP_BLANK) {
+        uuart_tx_byte(SERIAL_DUMP_RUN_BLANK | (run - 1));
+        return;
+    }
+    uuart_tx_byte(word >> 8);
+    uuart_tx_byte(word & 0xFF);
+    if (run > 1)
+        uuart_tx_byte(SERIAL_DUMP_RUN_LAST | (run - 2));
+}
+
+unsigned char cmd_dump(void)
+{
+    // Read <count> words starting at <address>, raw or run-length encoded.
+    recv_size = uuart_rx_bytes(input_buffer, 5);
+    unsigned char mode = input_buffer[0];
+    unsigned int address = (input_buffer[1] << 8) | input_buffer[2];
+    unsigned int count = (input_buffer[3] << 8) | input_buffer[4];
+
+    if (recv_size != 5 || (mode != SERIAL_DUMP_RAW && mode != SERIAL_DUMP_RLE) ||
+        !pic_behind_ok()) {
+        cmd_resp_error(input_buffer, recv_size);
+        return STATUS_PROGRAM;
+    }
+
+    cmd_resp(str_ok);
+    pic_load_address(address);
+
+    unsigned int word;
+    unsigned int run_word = 0;
+    unsigned char run = 0;
+    for (; count > 0; count--) {
+        word = pic_read_word(ICSP_CMD_READ_DATA_INC);
+
+        if (mode == SERIAL_DUMP_RAW) {
+            uuart_tx_byte(word >> 8);
+            uuart_tx_byte(word & 0xFF);
+            continue;
+        }
+
+        if (run && word == run_word && run < SERIAL_DUMP_RUN_MAX) {
+            run++;
+            continue;
+        }
+        if (run)
+            dump_flush(run_word, run);
+        run_word = word;
+        run = 1;
+    }
+    if (run)
+        dump_flush(run_word, run);
+
+    return STATUS_PROGRAM;
+}
+
+void cmd_resp_timing(void)
+{
+    cmd_resp(str_ok);
+    uuart_tx_byte(icsp_timing.ckh);
+    uuart_tx_byte(icsp_timing.ckl);
+    uuart_tx_byte(icsp_timing.dly);
+    uuart_tx_byte(icsp_timing.erab >> 8);
+    uuart_tx_byte(icsp_timing.erab & 0xFF);
+    uuart_tx_byte(icsp_timing.erar >> 8);
+    uuart_tx_byte(icsp_timing.erar & 0xFF);
+    uuart_tx_byte(icsp_timing.pint_pm >> 8);
+    uuart_tx_byte(icsp_timing.pint_pm & 0xFF);
+    uuart_tx_byte(icsp_timing.pint_cw >> 8);
+    uuart_tx_byte(icsp_timing.pint_cw & 0xFF);
+}
+
+unsigned char cmd_timing(void)
+{
+    unsigned char op = uuart_rx_byte();
+
+    if (op == SERIAL_TIMING_WRITE) {
+        recv_size = uuart_rx_bytes(input_buffer, 11);
+        if (recv_size != 11) {
+            cmd_resp_error(input_buffer, recv_size);
+            return STATUS_CONNECTED;
+        }
+        icsp_timing.ckh = input_buffer[0];
+        icsp_timing.ckl = input_buffer[1];
+        icsp_timing.dly = input_buffer[2];
+        icsp_timing.erab = (input_buffer[3] << 8) | input_buffer[4];
+        icsp_timing.erar = (input_buffer[5] << 8) | input_buffer[6];
+        icsp_timing.pint_pm = (input_buffer[7] << 8) | input_buffer[8];
+        icsp_timing.pint_cw = (input_buffer[9] << 8) | input_buffer[10];
+        if (!icsp_timing_check()) {
+            icsp_timing_load();
+            cmd_resp_error(input_buffer, recv_size);
+            return STATUS_CONNECTED;
+        }
+        icsp_timing_save();
+    }
+    else if (op == SERIAL_TIMING_DEFAULT) {
+        icsp_timing_defaults();
+        icsp_timing_save();
+    }
+    else if (op != SERIAL_TIMING_READ) {
+        cmd_resp_error(&op, 1);
+        return STATUS_CONNECTED;
+    }
+
+    cmd_resp_timing();
+    return STATUS_CONNECTED;
+}
+
+unsigned char cmd_calibrate(void)
+{
+    // Calibrate the clock and delay periods against a scratch row given by
+    // the host. Erase and write times are left alone, they can't be judged
+    // reliably by reading back a single row.
+    recv_size = uuart_rx_bytes(input_buffer, 2);
+    if (recv_size != 2 || !pic_behind_ok()) {
+        cmd_resp_error(input_buffer, recv_size);
+        return STATUS_PROGRAM;
+    }
+    unsigned int address = (input_buffer[0] << 8) | input_buffer[1];
+
+    icsp_timing.ckh = ICSP_DELAY_CKH;
+    icsp_timing.ckl = ICSP_DELAY_CKL;
+    icsp_timing.dly = ICSP_DELAY_DLY;
+
+    // Start from periods that work. A slow board or long leads may need
+    // longer than the defaults, double them until the row reads back.
+    while (!pic_test_row(address)) {
+        if (icsp_timing.ckh >= ICSP_CAL_MAX) {
+            icsp_timing_load();
+            icsp_disable();
+            icsp_enable();
+            cmd_resp(str_error);
+            return STATUS_PROGRAM;
+        }
+        icsp_timing.ckh = 2 * icsp_timing.ckh + 1;
+        icsp_timing.ckl = 2 * icsp_timing.ckl + 1;
+        icsp_timing.dly = 2 * icsp_timing.dly;
+        icsp_disable();
+        icsp_enable();
+    }
+
+    pic_calibrate(&icsp_timing.ckh, 0, address);
+    pic_calibrate(&icsp_timing.ckl, 0, address);
+    pic_calibrate(&icsp_timing.dly, ICSP_MIN_DLY, address);
+
+    // Leave the scratch row blank.
+    pic_erase_span(address);
+
+    icsp_timing_save();
+    cmd_resp_timing();
+    return STATUS_PROGRAM;
+}
+
+unsigned char cmd_session(void)
+{
+    // Begin a session, or report how far the current one got so the host
+    // can pick up after the last row counted.
+    unsigned char op = uuart_rx_byte();
+
+    // Frame sequence numbers start over with every session, and with
+    // every host that comes to ask about one.
+    frame_mask = 0;
+
+    if (op == SERIAL_SESSION_BEGIN) {
+        recv_size = uuart_rx_bytes(input_buffer, 2);
+        if (recv_size != 2) {
+            cmd_resp_error(input_buffer, recv_size);
+            return STATUS_CONNECTED;
+        }
+        session.token = (input_buffer[0] << 8) | input_buffer[1];
+        session_reset();
+    }
+    else if (op == SERIAL_SESSION_DROP) {
+        // last_crc is only good for the row counted last.
+        if (!session.droppable) {
+            cmd_resp_error(&op, 1);
+            return STATUS_CONNECTED;
+        }
+        session_drop();
+    }
+    else if (op != SERIAL_SESSION_QUERY) {
+        cmd_resp_error(&op, 1);
+        return STATUS_CONNECTED;
+    }
+
+    // Rows count again from here, the host carries on after the last one.
+    session.active = 1;
+
+    cmd_resp(str_ok);
+    uuart_tx_byte(session.token >> 8);
+    uuart_tx_byte(session.token & 0xFF);
+    uuart_tx_byte(session.rows >> 8);
+    uuart_tx_byte(session.rows & 0xFF);
+    uuart_tx_byte(session.crc >> 8);
+    uuart_tx_byte(session.crc & 0xFF);
+    uuart_tx_byte(session.last_crc >> 8);
+    uuart_tx_byte(session.last_crc & 0xFF);
+    return STATUS_CONNECTED;
+}
+
+
+unsigned char handle_idle(void)
+{
+    // Read ahead for sequential READs while there is nothing else to do.
+    if (!read_cache.valid || !read_cache.sequential || read_cache.count == READ_CACHE_SIZE ||
+        !icsp_ready())
+        return 0;
+
+    unsigned char *cached = read_cache_word((read_cache.first + read_cache.count) & (READ_CACHE_SIZE - 1));
+    unsigned int word = pic_read_word(ICSP_CMD_READ_DATA_INC);
+    cached[0] = word >> 8;
+    cached[1] = word & 0xFF;
+    read_cache.count++;
+    return 1;
+}
 
 unsigned char handle_command(void)
 {
     recv_size = uuart_rx_bytes_until(':', input_buffer, INPUT_BUFFER_SIZE);
+    if (uuart_rx_timeout()) {
+        cmd_resp_error(input_buffer, recv_size);
+        return 0;
+    }
+
+    // Anything but a READ moves the PIC's address, or leaves programming
+    // mode, so the words read ahead are no good after it. A name longer
+    // than READ has overwritten them.
+    if (recv_size != sizeof(SERIAL_CMD_READ) - 1 || !cmd_is(PSTR(SERIAL_CMD_READ))) {
+        read_cache.valid = 0;
+        read_cache.count = 0;
+    }
 
     // Greeting
-    if (cmd_is(SERIAL_CMD_HELLO))
+    if (cmd_is(PSTR(SERIAL_CMD_HELLO)))
         return cmd_hello();
 
-    else if (cmd_is(SERIAL_CMD_BYE))
+    else if (cmd_is(PSTR(SERIAL_CMD_BYE)))
         return cmd_bye();
 
-    else if (cmd_is(SERIAL_CMD_START))
+    else if (cmd_is(PSTR(SERIAL_CMD_START)))
         return cmd_start();
 
-    else if (cmd_is(SERIAL_CMD_STOP))
+    else if (cmd_is(PSTR(SERIAL_CMD_STOP)))
         return cmd_stop();
 
     // else if (cmd_is(SERIAL_CMD_ADDR)) This doesnt really need to be a command
     //     return cmd_addr();        since we specify address in all the others    
     
-    else if (cmd_is(SERIAL_CMD_WORD))
+    else if (cmd_is(PSTR(SERIAL_CMD_WORD)))
         return cmd_word();
     
-    else if (cmd_is(SERIAL_CMD_ROW))
+    else if (cmd_is(PSTR(SERIAL_CMD_ROW)))
         return cmd_row();
+
+    else if (cmd_is(PSTR(SERIAL_CMD_FROW)))
+        return cmd_frow();
     
-    else if (cmd_is(SERIAL_CMD_ERASE))
+    else if (cmd_is(PSTR(SERIAL_CMD_ERASE)))
         return cmd_erase();
     
-    else if (cmd_is(SERIAL_CMD_READ))
+    else if (cmd_is(PSTR(SERIAL_CMD_READ)))
         return cmd_read();
 
-    uuart_print("UNKOWN:");
+    else if (cmd_is(PSTR(SERIAL_CMD_DUMP)))
+        return cmd_dump();
+
+    else if (cmd_is(PSTR(SERIAL_CMD_BATCH)))
+        return cmd_batch();
+
+    else if (cmd_is(PSTR(SERIAL_CMD_TIMING)))
+        return cmd_timing();
+
+    else if (cmd_is(PSTR(SERIAL_CMD_CALIBRATE)))
+        return cmd_calibrate();
+
+    else if (cmd_is(PSTR(SERIAL_CMD_SESSION)))
+        return cmd_session();
+
+    // We can't tell how long an unknown command is, drop the rest of it
+    // until the host goes quiet so none of it is taken for commands. The
+    // name is echoed ended by a separator, it can't contain one.
+    while (!uuart_rx_timeout())
+        uuart_rx_byte();
+    uuart_flush_buffers();
+    uuart_print_P(PSTR("UNKOWN:"));
     uuart_tx_bytes(input_buffer, recv_size);
+    uuart_tx_byte(SERIAL_CMD_SEP);
     return 0;
 }
\ No newline at end of file
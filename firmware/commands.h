@@ -1,19 +1,87 @@
 #define SERIAL_CMD_SEP ':'
 #define SERIAL_CMD_OK "OK"
 #define SERIAL_CMD_ERROR "ERROR"
+#define SERIAL_CMD_NAK "NAK"
+#define SERIAL_CMD_TIMEOUT "TIMEOUT"
 #define SERIAL_CMD_HELLO "HELLO"
 #define SERIAL_CMD_BYE "BYE"
 #define SERIAL_CMD_START "START"
 #define SERIAL_CMD_STOP "STOP"
 #define SERIAL_CMD_ADDR "ADDR"
 #define SERIAL_CMD_ROW "ROW"
+// Words in a ROW, two of the PIC's rows and written as two. ERASE of a row
+// address erases only the PIC row it is in, as it always did.
+#define SERIAL_ROW_WORDS 64
+#define SERIAL_CMD_FROW "FROW"
 #define SERIAL_CMD_WORD "WORD"
 #define SERIAL_CMD_READ "READ"
 #define SERIAL_CMD_ERASE "ERASE"
 #define SERIAL_CMD_ERASE_ALL 0xFFFF
 #define SERIAL_CMD_ERASE_FLASH 0xFFFE
+#define SERIAL_CMD_BATCH "BATCH"
 
-#define INPUT_BUFFER_SIZE 135
+// BATCH:<length hi><length lo> then <length> bytes of operations, at most
+// SERIAL_BATCH_MAX, each <op> <arg hi> <arg lo> [data]. Replies OK:<count>
+// or ERROR:<index> of the first operation that failed or can't be framed.
+#define SERIAL_BATCH_MAX INPUT_BUFFER_SIZE
+#define SERIAL_BATCH_ADDR 'A'   // Load address <arg>
+#define SERIAL_BATCH_ERASE 'E'  // Erase row at <arg>, same special values as ERASE
+#define SERIAL_BATCH_WORD 'W'   // Write 2 data bytes to address <arg>
+#define SERIAL_BATCH_ROW 'R'    // Write 128 data bytes to row at <arg>
+#define SERIAL_BATCH_VERIFY 'V' // Verify current address reads <arg>, increment
+
+#define SERIAL_CMD_DUMP "DUMP"
+#define SERIAL_DUMP_RAW 'R'         // 2 bytes per word
+#define SERIAL_DUMP_RLE 'C'         // Run-length encoded, see below
+
+// Run-length encoded DUMP stream. Words are 14 bits, so a byte with either
+// of the top two bits set can't start a literal:
+//   00hhhhhh llllllll  literal word
+//   10nnnnnn           the last word repeated n+1 more times
+//   11nnnnnn           n+1 blank (0x3FFF) words
+#define SERIAL_DUMP_RUN_LAST 0x80
+#define SERIAL_DUMP_RUN_BLANK 0xC0
+#define SERIAL_DUMP_RUN_MAX 64
+#define SERIAL_DUMP_BLANK 0x3FFF
+
+#define SERIAL_CMD_TIMING "TIMING"
+#define SERIAL_TIMING_READ 'R'      // Reply with the timing profile
+#define SERIAL_TIMING_WRITE 'W'     // Set and save profile from 11 bytes, see icsp_timing_check()
+#define SERIAL_TIMING_DEFAULT 'D'   // Restore and save the default profile
+#define SERIAL_CMD_CALIBRATE "CALIBRATE"
+
+// Steps added back onto each calibrated period (in microseconds).
+#define ICSP_CAL_MARGIN 1
+// Longest clock period CALIBRATE lengthens to when the defaults don't work.
+#define ICSP_CAL_MAX 63
+
+#define SERIAL_CMD_SESSION "SESSION"
+#define SERIAL_SESSION_BEGIN 'B'    // Start a session with a 16 bit token
+#define SERIAL_SESSION_QUERY 'Q'    // Reply with token, rows and CRCs
+#define SERIAL_SESSION_DROP 'D'     // Forget the last row counted, once
+#define SERIAL_SESSION_CRC_INIT 0xFFFF
+
+// FROW frames: <address hi> <address lo> <seq> <128 data bytes> <crc hi> <crc lo>
+// The host may have up to SERIAL_FRAME_WINDOW frames unacknowledged. We
+// can't receive while we answer and only buffer 16 bytes while a row is
+// written, so a second frame sent behind the first is lost.
+#define SERIAL_FRAME_SIZE 133
+#define SERIAL_FRAME_CRC_INIT 0xFFFF
+#define SERIAL_FRAME_WINDOW 1
+
+// Holds a FROW frame, the largest thing received in one go.
+#define INPUT_BUFFER_SIZE SERIAL_FRAME_SIZE
+
+// ROW shifts each word into the PIC as it comes in, instead of after the
+// whole row is buffered, and answers before the last write is done. The row
+// is read back before the PIC is next used, and if it doesn't match, that
+// command, or STOP, answers ERROR in its place. 0 buffers first.
+#define ROW_WRITE_BEHIND 0
+#define ROW_CHECK_CRC_INIT 0xFFFF
+
+// Words read ahead for sequential READs, as a power of 2.
+#define READ_CACHE_BITS 2
+#define READ_CACHE_SIZE (1 << READ_CACHE_BITS)
 
 #define PICCHICK_GREETING "HELLO"
 
@@ -21,4 +89,7 @@
 
 int handle_connection(void);
 
-uint8_t handle_command(void);
\ No newline at end of file
+uint8_t handle_command(void);
+
+// Background work between commands. Returns 0 if there was none.
+uint8_t handle_idle(void);
\ No newline at end of file
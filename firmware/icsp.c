@@ -6,23 +6,27 @@
 */
 
 #include <avr/io.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
 #include <util/delay.h>
+#include <util/delay_basic.h>
 
 #include "icsp.h"
 
 
-// Startup bit sequence to enter programming mode is cleverly MCHIP in ascii.
-#define ICSP_STARTUP_KEY "MCHP"
+// The timing profile in use, and the copy of it persisted in EEPROM.
+struct icsp_timing icsp_timing;
+static unsigned char EEMEM icsp_timing_ee_magic;
+static struct icsp_timing EEMEM icsp_timing_ee;
 
-// ICSP Timings
-#define ICSP_DELAY_ENTH 250
-#define ICSP_DELAY_CKL 1
-#define ICSP_DELAY_CKH 1
-#define ICSP_DELAY_DLY 3
-#define ICSP_DELAY_ERAB 8600    // Bulk erase time takes max 8.4 ms
-#define ICSP_DELAY_ERAR 3000    // Row erase time is max 2.8 ms
-#define ICSP_DELAY_PINT_PM 3000 // Program memory internal timed takes max 2.8ms
-#define ICSP_DELAY_PINT_CW 5800 // Configuration word internally timed takes max 5.6 ms
+// The internally timed operation in progress: Timer1 count at its start
+// and its length in ticks, 0 if there is none. 16 bits like the timer, so
+// the difference wraps with it wherever this is built.
+static uint16_t icsp_busy_start;
+static uint16_t icsp_busy_ticks;
+
+// Shifted in to enter low voltage programming, kept out of SRAM.
+static const char icsp_startup_key[] PROGMEM = ICSP_STARTUP_KEY;
 
 
 
@@ -33,6 +37,11 @@
 #define pin_low(pin)    (ICSP_PORT &= ~(pin))
 #define pin_high(pin)    (ICSP_PORT |= (pin))
 
+// Wait a clock period. A period of 0 goes as fast as the port does, every
+// port write takes two cycles, longer than the 100ns minimum clock periods
+// up to 20MHz.
+#define icsp_period(us) do { if (us) icsp_delay_us(us); } while (0)
+
 
 // Internal functions.
 static void icsp_write (unsigned char data);
@@ -44,6 +53,109 @@ icsp_init (void)
     // Our target state for our three ICSP pins are inputs without pullup.
     // This is the default state for AVRs.
     icsp_pins_inputs();
+
+    // Timer1 free running, it is only ever read.
+    TCCR1B = (1<<CS11) | (1<<CS10);
+
+    icsp_timing_load();
+}
+
+
+void
+icsp_timing_defaults (void)
+{
+    icsp_timing.ckh = ICSP_DELAY_CKH;
+    icsp_timing.ckl = ICSP_DELAY_CKL;
+    icsp_timing.dly = ICSP_DELAY_DLY;
+    icsp_timing.erab = ICSP_DELAY_ERAB;
+    icsp_timing.erar = ICSP_DELAY_ERAR;
+    icsp_timing.pint_pm = ICSP_DELAY_PINT_PM;
+    icsp_timing.pint_cw = ICSP_DELAY_PINT_CW;
+}
+
+void
+icsp_timing_load (void)
+{
+    // A blank (or outdated) EEPROM won't have our magic byte, fall back to
+    // the compiled in defaults.
+    if (eeprom_read_byte(&icsp_timing_ee_magic) != ICSP_TIMING_MAGIC)
+    {
+        icsp_timing_defaults();
+        return;
+    }
+    eeprom_read_block(&icsp_timing, &icsp_timing_ee, sizeof(icsp_timing));
+    if (!icsp_timing_check())
+        icsp_timing_defaults();
+}
+
+unsigned char
+icsp_timing_check (void)
+{
+    // A 0 there is a garbled profile rather than a fast part.
+    if (!icsp_timing.dly || !icsp_timing.erab || !icsp_timing.erar ||
+        !icsp_timing.pint_pm || !icsp_timing.pint_cw)
+        return 0;
+
+    if (icsp_timing.erab < ICSP_MIN_ERAB)
+        icsp_timing.erab = ICSP_MIN_ERAB;
+    if (icsp_timing.erar < ICSP_MIN_ERAR)
+        icsp_timing.erar = ICSP_MIN_ERAR;
+    if (icsp_timing.pint_pm < ICSP_MIN_PINT_PM)
+        icsp_timing.pint_pm = ICSP_MIN_PINT_PM;
+    if (icsp_timing.pint_cw < ICSP_MIN_PINT_CW)
+        icsp_timing.pint_cw = ICSP_MIN_PINT_CW;
+    return 1;
+}
+
+void
+icsp_timing_save (void)
+{
+    // Invalidate the stored profile while it is being written, so a reset
+    // halfway through falls back to the defaults instead of loading half
+    // of the new one.
+    eeprom_update_byte(&icsp_timing_ee_magic, 0xFF);
+    eeprom_update_block(&icsp_timing, &icsp_timing_ee, sizeof(icsp_timing));
+    eeprom_update_byte(&icsp_timing_ee_magic, ICSP_TIMING_MAGIC);
+}
+
+void
+icsp_delay_us (unsigned int us)
+{
+    // _delay_us() needs a compile time constant, so we count down with
+    // _delay_loop_2() instead. It burns 4 cycles per iteration, and a count
+    // of 0 means 65536 iterations, so split long delays into chunks.
+    while (us > ICSP_DELAY_CHUNK)
+    {
+        _delay_loop_2(ICSP_DELAY_CHUNK * (F_CPU / 4000000UL));
+        us -= ICSP_DELAY_CHUNK;
+    }
+    if (us)
+    {
+        _delay_loop_2(us * (F_CPU / 4000000UL));
+    }
+}
+
+void
+icsp_busy (unsigned int us)
+{
+    icsp_busy_start = TCNT1;
+    icsp_busy_ticks = us / ICSP_TIMER_TICK_US + 1;
+}
+
+unsigned char
+icsp_ready (void)
+{
+    // Forget the operation once it is over, so the counter can't wrap
+    // around and make it look unfinished again.
+    if (icsp_busy_ticks && (uint16_t)(TCNT1 - icsp_busy_start) >= icsp_busy_ticks)
+        icsp_busy_ticks = 0;
+    return icsp_busy_ticks == 0;
+}
+
+void
+icsp_wait (void)
+{
+    while (!icsp_ready());
 }
 
 
@@ -51,7 +163,12 @@ void
 icsp_enable (void)
 {
     // To enter program mode, we set MCLR low and shift in the 32 bit startup key
-    
+
+    // A host that went away may have left us in program mode, where the
+    // key would be taken for commands. Leave it first.
+    if (ICSP_DDR & ICSP_PIN_MCLR)
+        icsp_disable();
+
     icsp_pins_outputs();    // Our pins are in an input state.
     icsp_pins_low();        // Set all pins low, including MCLR.
 
@@ -64,7 +181,7 @@ icsp_enable (void)
             pin_high(ICSP_PIN_CLK); // CLK High
 
             // Determine the next data bit in the startup sequence.
-            if ((ICSP_STARTUP_KEY[i]) & (1 << j))
+            if (pgm_read_byte(&icsp_startup_key[i]) & (1 << j))
             {
                 // Transmit a 1
                 pin_high(ICSP_PIN_DAT);
@@ -75,12 +192,12 @@ icsp_enable (void)
                 pin_low(ICSP_PIN_DAT);
             }
 
-            _delay_us(ICSP_DELAY_CKH); // Wait a Clock High period.
+            icsp_delay_us(icsp_timing.ckh); // Wait a Clock High period.
 
             // CLK low, this will cause the connected chip to latch the data.
             pin_low(ICSP_PIN_CLK);
 
-            _delay_us(ICSP_DELAY_CKL); // Wait a Clock low period.
+            icsp_delay_us(icsp_timing.ckl); // Wait a Clock low period.
         }
     }
 }
@@ -88,7 +205,8 @@ icsp_enable (void)
 void
 icsp_disable (void)
 {
-    // Exits programming mode
+    // Exits programming mode, after any write in progress.
+    icsp_wait();
 
     pin_high(ICSP_PIN_MCLR); // Set MCLR high to exit programming mode.
 
@@ -100,6 +218,8 @@ icsp_disable (void)
 void
 icsp_command (unsigned char command)
 {
+    // The PIC ignores commands while it is busy writing or erasing.
+    icsp_wait();
     icsp_write(command);
 }
 
@@ -110,19 +230,11 @@ icsp_payload (unsigned int data)
     // (7)  - Start + Padding 0s
     // (16) - Data bits
     // (1)  - Stop 0s
-    union {
-        unsigned char bytes[3];
-        long number;
-    } payload;
-    
-    // We can craft this payload by shifting the data left by one.
-    payload.number = data;
-    payload.number = payload.number << 1;
-
-    // Now we can write our payload by writing the 3 low bytes.
-    icsp_write(payload.bytes[2]);
-    icsp_write(payload.bytes[1]);
-    icsp_write(payload.bytes[0]);
+    // That is the data shifted left by one, taken a byte at a time so we
+    // don't need 32 bit arithmetic for it.
+    icsp_write(data >> 15);
+    icsp_write(data >> 7);
+    icsp_write(data << 1);
 }
 
 
@@ -140,9 +252,9 @@ icsp_read (void)
     for (i=0; i<9; i++)
     {
         pin_high(ICSP_PIN_CLK);
-        _delay_us(ICSP_DELAY_CKH);
+        icsp_period(icsp_timing.ckh);
         pin_low(ICSP_PIN_CLK);
-        _delay_us(ICSP_DELAY_CKL);
+        icsp_period(icsp_timing.ckl);
     }
 
     // Clock out 14 cycles and read the data bits on a CLK fall
@@ -150,24 +262,25 @@ icsp_read (void)
     {
         pin_high(ICSP_PIN_CLK);     // CLK High
 
-        _delay_us(ICSP_DELAY_CKH);  // Wait for chip to latch the next bit
+        icsp_period(icsp_timing.ckh);  // Wait for chip to latch the next bit
 
         pin_low(ICSP_PIN_CLK);      // ClK Low
 
         // Record data state.
+        word <<= 1;
         if (ICSP_PIN & ICSP_PIN_DAT)
         {
-            word |= (1U << i);
+            word |= 1;
         }
 
-        _delay_us(ICSP_DELAY_CKL);  // Wait a clock low period
+        icsp_period(icsp_timing.ckl);  // Wait a clock low period
     }
 
     // Clock out our stop bit totalling 24 bits
     pin_high(ICSP_PIN_CLK);
-    _delay_us(ICSP_DELAY_CKH);
+    icsp_period(icsp_timing.ckh);
     pin_low(ICSP_PIN_CLK);
-    _delay_us(ICSP_DELAY_CKL);
+    icsp_period(icsp_timing.ckl);
 
     // Set DAT pin back to output
     ICSP_DDR |= ICSP_PIN_DAT;
@@ -181,12 +294,31 @@ icsp_read (void)
 static void
 icsp_write (unsigned char data)
 {
-    for (int bit = 7; bit >= 0; bit--) { // Start with the MSb
+    unsigned char bit;
+
+    if (!icsp_timing.ckh && !icsp_timing.ckl)
+    {
+        // Shift as fast as the port goes, with nothing but the bit test
+        // between the clock edges.
+        for (bit = 8; bit; bit--)
+        {
+            pin_high(ICSP_PIN_CLK);
+            if (data & 0x80)
+                pin_high(ICSP_PIN_DAT);
+            else
+                pin_low(ICSP_PIN_DAT);
+            data <<= 1;
+            pin_low(ICSP_PIN_CLK);
+        }
+        return;
+    }
+
+    for (bit = 8; bit; bit--) { // Start with the MSb
 
         pin_high(ICSP_PIN_CLK); // CLK High
 
         // Determine the next data bit in the command.
-        if (data & (1 << bit))
+        if (data & 0x80)
         {
             // Transmit a 1
             pin_high(ICSP_PIN_DAT);
@@ -196,11 +328,12 @@ icsp_write (unsigned char data)
             // Transmit a 0
             pin_low(ICSP_PIN_DAT);
         }
-        
-        _delay_us(ICSP_DELAY_CKH);
+        data <<= 1;
+
+        icsp_delay_us(icsp_timing.ckh);
 
         pin_low(ICSP_PIN_CLK); // CLK Low
 
-        _delay_us(ICSP_DELAY_CKL);
+        icsp_delay_us(icsp_timing.ckl);
     }
 }
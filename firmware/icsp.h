@@ -29,11 +29,20 @@
 #define ICSP_CMD_START_EXT 0xC0
 #define ICSP_CMD_STOP_EXT 0x82
 
+// Words the PIC erases and writes at a time, the size of its write latches.
+#define ICSP_ROW_WORDS 32
+
+// Bits in a word of program memory.
+#define ICSP_WORD_MASK 0x3FFF
+
 // Startup bit sequence to enter programming mode is cleverly MCHIP in ascii.=
 #define ICSP_STARTUP_KEY "MCHP"
 
 // ICSP Timings
+// Everything but ENTH is only a default for the runtime timing profile below.
 #define ICSP_DELAY_ENTH 250
+// Clock periods of 0 shift at port speed, see icsp_write(). CALIBRATE takes
+// them there on a board that keeps up.
 #define ICSP_DELAY_CKL 1
 #define ICSP_DELAY_CKH 1
 #define ICSP_DELAY_DLY 3
@@ -42,10 +51,71 @@
 #define ICSP_DELAY_PINT_PM 3000 // Program memory internal timed takes max 2.8ms
 #define ICSP_DELAY_PINT_CW 5800 // Configuration word internally timed takes max 5.6 ms
 
+// Datasheet minimums a timing profile is held to. Clock periods of 0 are
+// fine, port speed is slower than the 100ns minimum.
+#define ICSP_MIN_DLY 1          // TDLY 1 us
+#define ICSP_MIN_ERAB 8400
+#define ICSP_MIN_ERAR 2800
+#define ICSP_MIN_PINT_PM 2800
+#define ICSP_MIN_PINT_CW 5600
+
+// Longest single delay loop in icsp_delay_us(), in microseconds.
+#define ICSP_DELAY_CHUNK 1000
+
+// Marks a valid timing profile in EEPROM. Change it if the layout changes.
+#define ICSP_TIMING_MAGIC 0xA5
+
+// Timer1 runs freely at F_CPU/64 to time the PIC's internally timed
+// operations, while the firmware gets on with other things.
+#define ICSP_TIMER_PRESCALE 64
+#define ICSP_TIMER_TICK_US (ICSP_TIMER_PRESCALE * 1000000UL / F_CPU)
+
+// Runtime timing profile, all values in microseconds.
+struct icsp_timing {
+    unsigned char ckh;      // Clock high period
+    unsigned char ckl;      // Clock low period
+    unsigned char dly;      // Delay between command and payload
+    unsigned int erab;      // Bulk erase time
+    unsigned int erar;      // Row erase time
+    unsigned int pint_pm;   // Program memory internally timed write
+    unsigned int pint_cw;   // Configuration word internally timed write
+};
+
+extern struct icsp_timing icsp_timing;
+
 
 
+/** Initialize the ICSP pins, start Timer1 and load the timing profile from
+ *  EEPROM. */
 void        icsp_init (void);
 
+/** Reset the timing profile to the compiled in defaults. */
+void        icsp_timing_defaults (void);
+
+/** Load the timing profile from EEPROM, or the defaults if there is none. */
+void        icsp_timing_load (void);
+
+/** Check the timing profile, raising anything shorter than the datasheet
+ *  allows to its minimum. Returns 0 if a delay, erase or write time is 0. */
+unsigned char icsp_timing_check (void);
+
+/** Persist the current timing profile to EEPROM. */
+void        icsp_timing_save (void);
+
+/** Busy wait for a number of microseconds that is not known at compile time. */
+void        icsp_delay_us (unsigned int us);
+
+/** Mark the PIC busy with an internally timed operation for the next us
+ *  microseconds. The next command, or leaving programming mode, waits for
+ *  it to finish first. */
+void        icsp_busy (unsigned int us);
+
+/** Wait until the PIC is done with any internally timed operation. */
+void        icsp_wait (void);
+
+/** Returns 1 if the PIC is done with any internally timed operation. */
+unsigned char icsp_ready (void);
+
 /** Enter the connected chip into ICSP programming mode. */
 void        icsp_enable (void);
 
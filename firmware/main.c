@@ -34,5 +34,9 @@ main (void)
             handle_command();
             PORTB &= ~(1 << 2);
         }
+        else
+        {
+            handle_idle();
+        }
     }
 }
\ No newline at end of file
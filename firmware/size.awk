@@ -0,0 +1,93 @@
+# size.awk - Flash and SRAM use per module, from an avr-ld map file.
+#
+#   awk -v flash=4096 -v sram=256 -v flash_headroom=128 -v sram_headroom=64 \
+#       -v stack=120 -f size.awk picstickfw.map
+#
+# Initialised data counts towards both, it is copied from flash at startup.
+# Whatever SRAM is left is the stack, so the exit status is 1 if less than
+# the headroom is left of either, or less SRAM than the worst case stack
+# from stack.awk.
+
+function hex(s,    i, n)
+{
+    n = 0
+    s = tolower(substr(s, 3))
+    for (i = 1; i <= length(s); i++)
+        n = n * 16 + index("0123456789abcdef", substr(s, i, 1)) - 1
+    return n
+}
+
+function add(section, size, file,    module)
+{
+    module = file
+    sub(/.*\//, "", module)     # Drop the directory
+    sub(/\(.*\)$/, "", module)  # Archive members count towards the archive
+    size = hex(size)
+    if (size == 0)
+        return
+
+    if (section ~ /^\.(data|rodata)/) {
+        flash_use[module] += size
+        sram_use[module] += size
+    }
+    else if (section ~ /^(\.bss|\.noinit|COMMON)/)
+        sram_use[module] += size
+    else if (section ~ /^\.(text|progmem|vectors|trampolines|init|fini|ctors|dtors|jumptables)/)
+        flash_use[module] += size
+    else
+        return
+    if (!(module in seen)) {
+        seen[module] = 1
+        modules[++count] = module
+    }
+}
+
+/^Linker script and memory map/ { in_map = 1; next }
+!in_map { next }
+
+# Input sections are indented; long names put the rest on the next line.
+/^ [.A-Z]/ {
+    if (NF == 1) {
+        pending = $1
+        next
+    }
+    if (NF >= 4 && $2 ~ /^0x/ && $3 ~ /^0x/)
+        add($1, $3, $4)
+    pending = ""
+    next
+}
+pending != "" && NF >= 3 && $1 ~ /^0x/ && $2 ~ /^0x/ {
+    add(pending, $2, $3)
+    pending = ""
+    next
+}
+{ pending = "" }
+
+END {
+    printf "%-24s %8s %8s\n", "module", "flash", "sram"
+    for (i = 1; i <= count; i++) {
+        m = modules[i]
+        printf "%-24s %8d %8d\n", m, flash_use[m], sram_use[m]
+        flash_total += flash_use[m]
+        sram_total += sram_use[m]
+    }
+    printf "%-24s %8d %8d\n", "total", flash_total, sram_total
+    printf "%-24s %8d %8d\n", "free", flash - flash_total, sram - sram_total
+
+    status = 0
+    if (flash - flash_total < flash_headroom) {
+        printf "Error: %d bytes of flash free, need at least %d\n", flash - flash_total, flash_headroom
+        status = 1
+    }
+    if (stack != "")
+        printf "%-24s %8s %8d\n", "worst case stack", "", stack
+    if (sram - sram_total < sram_headroom) {
+        printf "Error: %d bytes of SRAM free for the stack, need at least %d\n", sram - sram_total, sram_headroom
+        status = 1
+    }
+    if (stack != "" && sram - sram_total < stack) {
+        printf "Error: %d bytes of SRAM free, the worst case stack takes %d\n", sram - sram_total, stack
+        status = 1
+    }
+    exit status
+}
@@ -0,0 +1,132 @@
+# stack.awk - Worst case stack depth, from the call graphs gcc writes with
+# -fstack-usage -fcallgraph-info=su.
+#
+#   awk -f stack.awk build/*.ci
+#   awk -v quiet=1 -f stack.awk build/*.ci
+#
+# The worst case is main's deepest call chain plus the deepest interrupt
+# handler: handlers don't enable interrupts, so they don't nest. Functions
+# without a figure, library calls mostly, count as unknown bytes (default
+# 4) and are listed. With quiet set only the total is printed, for
+# size.awk. The exit status is 1 on recursion or a dynamic frame, where
+# there is no worst case to give.
+
+function worst(f,    e, d, best, via)
+{
+    if (f in depth)
+        return depth[f]
+    if (f in visiting) {
+        recursive[f] = 1
+        return 0
+    }
+    visiting[f] = 1
+
+    best = 0
+    via = ""
+    for (e = 1; e <= ncalls[f]; e++) {
+        d = worst(calls[f, e])
+        if (d > best) {
+            best = d
+            via = calls[f, e]
+        }
+    }
+    delete visiting[f]
+
+    if (!(f in bytes)) {
+        bytes[f] = unknown
+        missing[f] = 1
+    }
+    next_in_chain[f] = via
+    depth[f] = bytes[f] + best
+    return depth[f]
+}
+
+function name(f)
+{
+    sub(/.*:/, "", f)   # Static functions are titled file:name
+    return f
+}
+
+function chain(f,    s)
+{
+    s = name(f)
+    for (f = next_in_chain[f]; f != ""; f = next_in_chain[f])
+        s = s " > " name(f)
+    return s
+}
+
+function field(s, key,    i)
+{
+    i = index(s, key "\"")
+    if (!i)
+        return ""
+    s = substr(s, i + length(key) + 1)
+    return substr(s, 1, index(s, "\"") - 1)
+}
+
+BEGIN {
+    if (unknown == "")
+        unknown = 4
+}
+
+/^node:/ {
+    f = field($0, "title: ")
+    label = field($0, "label: ")
+    if (match(label, /[0-9]+ bytes \([a-z,]+\)/)) {
+        split(substr(label, RSTART, RLENGTH), b, " ")
+        bytes[f] = b[1] + 0
+        if (b[3] != "(static)")
+            dynamic[f] = 1
+    }
+    next
+}
+
+/^edge:/ {
+    f = field($0, "sourcename: ")
+    calls[f, ++ncalls[f]] = field($0, "targetname: ")
+    next
+}
+
+END {
+    # avr-gcc names handlers __vector_N, host gcc keeps the ISR() name.
+    for (f in bytes)
+        if (name(f) ~ /^__vector_[0-9]+$|_vect$/)
+            handlers[f] = 1
+
+    total = worst("main")
+    deepest = ""
+    for (f in handlers)
+        if (deepest == "" || worst(f) > worst(deepest))
+            deepest = f
+    if (deepest != "")
+        total += worst(deepest)
+
+    status = 0
+    for (f in recursive) {
+        if (!quiet)
+            printf "Error: %s is recursive\n", name(f)
+        status = 1
+    }
+    for (f in dynamic) {
+        if (!quiet)
+            printf "Error: %s has a dynamic frame\n", name(f)
+        status = 1
+    }
+
+    if (quiet) {
+        print total
+        exit status
+    }
+
+    printf "%-12s %5d  %s\n", "main", worst("main"), chain("main")
+    for (f in handlers)
+        printf "%-12s %5d  %s\n", "interrupt", worst(f), chain(f)
+    printf "%-12s %5d  main and %s\n", "worst", total, deepest == "" ? "no interrupt" : name(deepest)
+
+    n = 0
+    for (f in missing)
+        list = list (n++ ? ", " : "") name(f)
+    if (n)
+        printf "Counted as %d bytes each: %s\n", unknown, list
+    exit status
+}
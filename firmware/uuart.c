@@ -5,6 +5,8 @@
  */
 #include <avr/io.h>			// uController specific registers
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
 #include <stdlib.h>			// for itoa() function
 //#include <util/delay.h>		// for debugging main()
 
@@ -31,7 +33,7 @@ static volatile union uuart_status {
         unsigned char ongoing_Transmission_Of_Package:1;
         unsigned char ongoing_Reception_Of_Package:1;
         unsigned char reception_Buffer_Overflow:1;
-        unsigned char flag4:1;
+        unsigned char reception_Timeout:1;
         unsigned char flag5:1;
         unsigned char flag6:1;
         unsigned char flag7:1;
@@ -68,15 +70,21 @@ unsigned char Bit_Reverse( unsigned char x ) {
 }
 
 /*
- * Flush the UART buffers.
+ * Flush the UART buffers, once the last byte has gone out, and clear a
+ * receive timeout. Bytes received but not read yet are dropped.
  * @param void
  * @return void
  */
 void uuart_flush_buffers( void ) {
-    uuart_rx_tail = 0;
-    uuart_rx_head = 0;
-    uuart_tx_tail = 0;
-    uuart_tx_head = 0;
+    while (uuart_status.ongoing_Transmission_From_Buffer);
+    // The RX interrupt moves the head, keep it out while we reset it.
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        uuart_status.reception_Timeout = FALSE;
+        uuart_rx_tail = 0;
+        uuart_rx_head = 0;
+        uuart_tx_tail = 0;
+        uuart_tx_head = 0;
+    }
 }
 
 /*
@@ -144,14 +152,23 @@ uuart_tx_bytes (unsigned char *buf, unsigned char len)
 }
 
 /**
- * Returns a byte from the receive buffer. Waits if buffer is empty.
+ * Returns a byte from the receive buffer. Waits if buffer is empty, for up
+ * to UART_RX_TIMEOUT_MS. After a timeout it returns 0 straight away, until
+ * the buffers are flushed.
  * @param void
  * @return data from the buffer: unsigned char
  */
 unsigned char uuart_rx_byte( void ) {
     unsigned char tmptail;
-        
-    while ( uuart_rx_head == uuart_rx_tail );             // Wait for incoming data
+    unsigned int start = TCNT1;
+
+    while ( uuart_rx_head == uuart_rx_tail ) {            // Wait for incoming data
+        if ( uuart_status.reception_Timeout ||
+             (unsigned int)(TCNT1 - start) >= UART_RX_TIMEOUT_TICKS ) {
+            uuart_status.reception_Timeout = TRUE;
+            return 0;
+        }
+    }
     // Calculate buffer index and if necessary, roll over at upper bound
     tmptail = ( uuart_rx_tail + 1 ) & UART_RX_BUFFER_MASK;
     uuart_rx_tail = tmptail;                                // Store new index 
@@ -168,7 +185,10 @@ uuart_rx_bytes (unsigned char *buf, unsigned char len)
 
     while (bytes_read < len)
     {
-        buf[bytes_read++] = uuart_rx_byte();
+        buf[bytes_read] = uuart_rx_byte();
+        if (uuart_status.reception_Timeout)
+            break;
+        bytes_read++;
     }
     return bytes_read;
 }
@@ -182,6 +202,8 @@ uuart_rx_bytes_until (unsigned char sep, unsigned char *buf, unsigned char len)
     while (bytes_read < len)
     {
         read_byte = uuart_rx_byte();
+        if (uuart_status.reception_Timeout)
+            return bytes_read;
         if (read_byte == sep)
         {
             return bytes_read;
@@ -200,6 +222,14 @@ unsigned char uuart_rx_data_available( void ) {
     return ( uuart_rx_head != uuart_rx_tail );
 }
 
+/**
+ * Check if a receive timed out since the buffers were last flushed.
+ * @return  0 (FALSE) if none did: unsigned char
+ */
+unsigned char uuart_rx_timeout( void ) {
+    return uuart_status.reception_Timeout;
+}
+
 
 // ********** Interrupt Handlers ********** //
 
@@ -346,16 +376,27 @@ void uuart_print(char *str) {
     // uuart_tx_byte('\n');
 }
 
+/**
+ * Send a string of characters stored in program memory
+ * @param str - pointer to the string in flash, i.e. from PSTR()
+ */
+void uuart_print_P(const char *str) {
+	char c;
+	while ((c = pgm_read_byte(str++))) {
+		uuart_tx_byte(c);
+	}
+}
+
 void uuart_showbits(int byte) {
 	char buf[17];
 	itoa(byte, buf, 2);
-	uuart_print("0b");
+	uuart_print_P(PSTR("0b"));
 	uuart_print(buf);
 }
 
 void uuart_showhex(int byte) {
 	char buf[17];
 	itoa(byte, buf, 16);
-	uuart_print("0x");
+	uuart_print_P(PSTR("0x"));
 	uuart_print(buf);
 }
@@ -9,9 +9,14 @@
 #define BAUDRATE			76800
 
 // Buffer size must be a power of 2
-#define UART_RX_BUFFER_SIZE     4
+#define UART_RX_BUFFER_SIZE     16
 #define UART_TX_BUFFER_SIZE     4
 
+// Give up waiting for a byte this long after the last one. Counted on
+// Timer1, which icsp_init() starts running freely at F_CPU/64.
+#define UART_RX_TIMEOUT_MS      20
+#define UART_RX_TIMEOUT_TICKS   (UART_RX_TIMEOUT_MS * (F_CPU / 64 / 1000))
+
 /** USI UART Functions **/
 
 void		uuart_init(void);
@@ -25,8 +30,10 @@ unsigned char   uuart_rx_bytes(unsigned char *buf, unsigned char len);
 unsigned char   uuart_rx_bytes_until(unsigned char sep, unsigned char *buf, unsigned char len);
 
 unsigned char	uuart_rx_data_available(void);
+unsigned char	uuart_rx_timeout(void);		// a receive timed out since the last flush
 
 void		  uuart_print(char *str);		// transmit a string
+void		  uuart_print_P(const char *str);	// transmit a string from flash
 void 		  uuart_showbits(int byte);	// show binary value
 void		  uuart_showhex(int byte);
 
@@ -0,0 +1,543 @@
+/** @file client.cpp
+ *
+ * The picstick protocol on top of the transport.
+ *
+*/
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <stdexcept>
+
+#include "client.h"
+
+#include "commands.h"
+
+namespace picstick {
+
+static request
+command (const char *name, std::initializer_list<uint8_t> args = {})
+{
+    request req;
+    std::string cmd = name;
+    req.bytes.assign(cmd.begin(), cmd.end());
+    req.bytes.push_back(SERIAL_CMD_SEP);
+    req.bytes.insert(req.bytes.end(), args);
+    return req;
+}
+
+static void
+push_word (std::vector<uint8_t> &bytes, uint16_t word)
+{
+    bytes.push_back(word >> 8);
+    bytes.push_back(word & 0xFF);
+}
+
+static uint16_t
+crc_update (uint16_t crc, uint8_t data)
+{
+    // CRC-CCITT as in avr-libc's _crc_ccitt_update().
+    crc ^= data;
+    for (int bit = 0; bit < 8; bit++)
+    {
+        crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : crc >> 1;
+    }
+    return crc;
+}
+
+static uint16_t
+crc_word (uint16_t crc, uint16_t word)
+{
+    crc = crc_update(crc, word >> 8);
+    return crc_update(crc, word & 0xFF);
+}
+
+static uint16_t
+crc_row (uint16_t crc, const row &r)
+{
+    crc = crc_word(crc, r.address);
+    for (uint16_t w : r.words)
+    {
+        crc = crc_word(crc, w);
+    }
+    return crc;
+}
+
+static void
+check (const response &r, const char *what)
+{
+    if (r.status != SERIAL_CMD_OK && r.status != SERIAL_CMD_HELLO && r.status != SERIAL_CMD_BYE)
+        throw std::runtime_error(std::string(what) + " failed: " + r.status);
+}
+
+request
+row_request (const row &r)
+{
+    request req = command(SERIAL_CMD_FROW);
+    push_word(req.bytes, r.address);
+    req.bytes.push_back(0);
+    for (uint16_t w : r.words)
+    {
+        push_word(req.bytes, w);
+    }
+    push_word(req.bytes, 0);
+    set_frame_seq(req, 0);
+    req.ok_len = 1;
+    req.error_len = 1;
+    return req;
+}
+
+void
+set_frame_seq (request &frame, uint8_t seq)
+{
+    // The frame follows the command name and separator.
+    size_t start = frame.bytes.size() - SERIAL_FRAME_SIZE;
+    frame.bytes[start + 2] = seq;
+
+    uint16_t crc = SERIAL_FRAME_CRC_INIT;
+    for (size_t i = start; i < frame.bytes.size() - 2; i++)
+    {
+        crc = crc_update(crc, frame.bytes[i]);
+    }
+    frame.bytes[frame.bytes.size() - 2] = crc >> 8;
+    frame.bytes[frame.bytes.size() - 1] = crc & 0xFF;
+}
+
+std::vector<request>
+row_requests (const plan &p)
+{
+    std::vector<request> rows;
+    rows.reserve(p.rows.size());
+    for (const row &r : p.rows)
+    {
+        rows.push_back(row_request(r));
+    }
+    return rows;
+}
+
+std::vector<uint8_t>
+batch_op (uint8_t op, uint16_t arg, std::initializer_list<uint8_t> data)
+{
+    std::vector<uint8_t> bytes = {op};
+    push_word(bytes, arg);
+    bytes.insert(bytes.end(), data);
+    return bytes;
+}
+
+uint16_t
+session_token (const plan &p)
+{
+    uint16_t crc = session_crc(p, p.rows.size());
+    for (const auto &w : p.config)
+    {
+        crc = crc_word(crc_word(crc, w.first), w.second);
+    }
+    return crc;
+}
+
+uint16_t
+session_crc (const plan &p, size_t rows)
+{
+    uint16_t crc = SERIAL_SESSION_CRC_INIT;
+    for (size_t i = 0; i < rows && i < p.rows.size(); i++)
+    {
+        crc = crc_row(crc, p.rows[i]);
+    }
+    return crc;
+}
+
+
+client::client (const std::string &port, unsigned baud, unsigned window)
+    : link(port, baud, window)
+{
+}
+
+response
+client::call (request req)
+{
+    return link.send(std::move(req)).get();
+}
+
+void
+client::hello (void)
+{
+    request req = command(SERIAL_CMD_HELLO);
+    req.ok = SERIAL_CMD_HELLO;
+    check(call(req), "HELLO");
+}
+
+void
+client::bye (void)
+{
+    request req = command(SERIAL_CMD_BYE);
+    req.ok = SERIAL_CMD_BYE;
+    check(call(req), "BYE");
+}
+
+void
+client::resync (void)
+{
+    // Once the line has been quiet for its receive timeout, the stick drops
+    // any command it was halfway through and answers TIMEOUT:, which is
+    // dropped here with anything else it still had to say. If it was busy
+    // sending after all, the first HELLO may get the wrong reply.
+    for (int attempt = 0; ; attempt++)
+    {
+        usleep((PICSTICK_RX_TIMEOUT_MS + PICSTICK_RESYNC_MS) * 1000);
+        try
+        {
+            hello();
+            return;
+        }
+        catch (const std::runtime_error &)
+        {
+            if (attempt == 2)
+                throw;
+        }
+    }
+}
+
+void
+client::start (void)
+{
+    check(call(command(SERIAL_CMD_START)), "START");
+}
+
+void
+client::stop (void)
+{
+    check(call(command(SERIAL_CMD_STOP)), "STOP");
+}
+
+void
+client::abandon (void)
+{
+    // Whatever failed may have left a request half sent or its reply half
+    // read, so resync first. Nothing here is worth failing over.
+    try
+    {
+        link.abort("abandoned");
+        resync();
+        stop();
+        bye();
+    }
+    catch (const std::exception &)
+    {
+    }
+}
+
+void
+client::erase (uint16_t address)
+{
+    check(call(command(SERIAL_CMD_ERASE, {(uint8_t)(address >> 8), (uint8_t)address})), "ERASE");
+}
+
+void
+client::write_word (uint16_t address, uint16_t word)
+{
+    request req = command(SERIAL_CMD_WORD);
+    push_word(req.bytes, address);
+    req.bytes.push_back(SERIAL_CMD_SEP);
+    push_word(req.bytes, word);
+    req.error_len = 5;
+    check(call(req), "WORD");
+}
+
+uint16_t
+client::read (uint16_t address)
+{
+    request req = command(SERIAL_CMD_READ, {(uint8_t)(address >> 8), (uint8_t)address});
+    req.ok_len = 2;
+    response r = call(req);
+    check(r, "READ");
+    return (r.data[0] << 8) | r.data[1];
+}
+
+void
+client::batch (const std::vector<std::vector<uint8_t>> &ops)
+{
+    size_t done = 0;
+    while (done < ops.size())
+    {
+        std::vector<uint8_t> block;
+        size_t count = 0;
+        while (done + count < ops.size() &&
+               block.size() + ops[done + count].size() <= SERIAL_BATCH_MAX)
+        {
+            block.insert(block.end(), ops[done + count].begin(), ops[done + count].end());
+            count++;
+        }
+        if (count == 0)
+            throw std::runtime_error("BATCH operation too long");
+
+        request req = command(SERIAL_CMD_BATCH);
+        push_word(req.bytes, block.size());
+        req.bytes.insert(req.bytes.end(), block.begin(), block.end());
+        req.ok_len = 1;
+        req.error_len = 1;
+        response r = call(req);
+        if (r.status == SERIAL_CMD_ERROR && r.data.size() == 1)
+            throw std::runtime_error("BATCH failed at operation " + std::to_string(done + r.data[0]));
+        check(r, "BATCH");
+        done += count;
+    }
+}
+
+static session
+parse_session (const response &r)
+{
+    check(r, "SESSION");
+    session s;
+    s.token = (r.data[0] << 8) | r.data[1];
+    s.rows = (r.data[2] << 8) | r.data[3];
+    s.crc = (r.data[4] << 8) | r.data[5];
+    s.last_crc = (r.data[6] << 8) | r.data[7];
+    return s;
+}
+
+session
+client::session_begin (uint16_t token)
+{
+    request req = command(SERIAL_CMD_SESSION, {SERIAL_SESSION_BEGIN, (uint8_t)(token >> 8), (uint8_t)token});
+    req.ok_len = 8;
+    req.error_len = 1;
+    return parse_session(call(req));
+}
+
+session
+client::session_query (void)
+{
+    request req = command(SERIAL_CMD_SESSION, {SERIAL_SESSION_QUERY});
+    req.ok_len = 8;
+    req.error_len = 1;
+    return parse_session(call(req));
+}
+
+session
+client::session_drop (void)
+{
+    request req = command(SERIAL_CMD_SESSION, {SERIAL_SESSION_DROP});
+    req.ok_len = 8;
+    req.error_len = 1;
+    return parse_session(call(req));
+}
+
+size_t
+client::resume_point (const plan &p)
+{
+    // Only trust the rows if they are the start of this very plan.
+    session s = session_query();
+    if (s.token != session_token(p) || s.rows > p.rows.size())
+        return 0;
+    if (s.crc == session_crc(p, s.rows))
+        return s.rows;
+    if (s.rows == 0 || s.last_crc != session_crc(p, s.rows - 1))
+        return 0;
+
+    // The last row was finished off with something else, write it again.
+    // ERASE takes one PIC row at a time.
+    session_drop();
+    for (uint16_t offset = 0; offset < PICSTICK_ROW_WORDS; offset += PICSTICK_ERASE_WORDS)
+        erase(p.rows[s.rows - 1].address + offset);
+    return s.rows - 1;
+}
+
+std::vector<uint16_t>
+client::dump (uint16_t address, uint32_t count)
+{
+    std::vector<uint16_t> words;
+    words.reserve(count);
+
+    while (count > 0)
+    {
+        uint16_t n = (count > 0xFFFF) ? 0xFFFF : count;
+
+        // Decode as the bytes come in, so the reply knows where it ends.
+        auto out = std::make_shared<std::vector<uint16_t>>();
+        auto literal = std::make_shared<int>(-1);
+        auto last = std::make_shared<uint16_t>(SERIAL_DUMP_BLANK);
+
+        request req = command(SERIAL_CMD_DUMP, {SERIAL_DUMP_RLE,
+                              (uint8_t)(address >> 8), (uint8_t)address,
+                              (uint8_t)(n >> 8), (uint8_t)n});
+        req.error_len = 5;
+        req.ok_feed = [=](uint8_t byte) {
+            if (*literal >= 0)
+            {
+                *last = (*literal << 8) | byte;
+                out->push_back(*last);
+                *literal = -1;
+            }
+            else if ((byte & SERIAL_DUMP_RUN_BLANK) == SERIAL_DUMP_RUN_BLANK)
+            {
+                out->insert(out->end(), (byte & 0x3F) + 1, SERIAL_DUMP_BLANK);
+                *last = SERIAL_DUMP_BLANK;
+            }
+            else if (byte & SERIAL_DUMP_RUN_LAST)
+            {
+                out->insert(out->end(), (byte & 0x3F) + 1, *last);
+            }
+            else
+            {
+                *literal = byte;
+            }
+            return out->size() >= n;
+        };
+
+        check(call(req), "DUMP");
+        words.insert(words.end(), out->begin(), out->end());
+        address += n;
+        count -= n;
+    }
+    return words;
+}
+
+void
+client::program (const plan &p, bool erase_first)
+{
+    program(p, row_requests(p), erase_first);
+}
+
+void
+client::program (const plan &p, const std::vector<request> &rows, bool erase_first,
+                 size_t first)
+{
+    if (first == 0)
+    {
+        if (erase_first)
+            erase(p.config.empty() ? PICSTICK_ERASE_FLASH : PICSTICK_ERASE_ALL);
+        session_begin(session_token(p));
+    }
+
+    write_rows(p, rows, first);
+
+    std::vector<std::vector<uint8_t>> words;
+    for (const auto &w : p.config)
+    {
+        words.push_back(batch_op(SERIAL_BATCH_WORD, w.first, {(uint8_t)(w.second >> 8), (uint8_t)w.second}));
+    }
+    batch(words);
+}
+
+void
+client::write_rows (const plan &p, const std::vector<request> &rows, size_t first)
+{
+    struct frame
+    {
+        size_t                  row;
+        uint8_t                 seq;
+        unsigned                tries;
+        std::future<response>   reply;
+    };
+
+    // Rows still to send, with the sequence number they were first sent
+    // with, so a row sent again is known to the stick.
+    std::deque<frame> todo;
+    for (size_t i = first; i < rows.size(); i++)
+    {
+        todo.push_back({i, next_seq++, 0, {}});
+    }
+
+    std::deque<frame> inflight;
+    // The stick takes one frame at a time, see SERIAL_FRAME_WINDOW.
+    unsigned window = std::min<unsigned>(link.window, SERIAL_FRAME_WINDOW);
+    unsigned resyncs = 0;
+    size_t sent = first;
+
+    while (!todo.empty() || !inflight.empty())
+    {
+        while (!todo.empty() && inflight.size() < window)
+        {
+            frame f = std::move(todo.front());
+            todo.pop_front();
+
+            request req = rows[f.row];
+            set_frame_seq(req, f.seq);
+            if (f.tries++)
+                retransmits++;
+            sent = std::max(sent, f.row + 1);
+            f.reply = link.send(std::move(req));
+            inflight.push_back(std::move(f));
+        }
+
+        frame f = std::move(inflight.front());
+        inflight.pop_front();
+
+        // Anything but OK or NAK means the stick lost track of the frames,
+        // as do lost or garbled replies. Any frame in flight may or may not
+        // have been written, and the session stopped counting at the first
+        // one that wasn't. Resync and carry on from where it got to.
+        response r;
+        try
+        {
+            r = f.reply.get();
+        }
+        catch (const std::runtime_error &)
+        {
+            r.status.clear();
+        }
+
+        std::string what = "ROW " + std::to_string(p.rows[f.row].address);
+        if (r.status == SERIAL_CMD_NAK)
+        {
+            if (f.tries > PICSTICK_FRAME_RETRIES)
+                throw std::runtime_error(what + " failed: damaged " + std::to_string(f.tries) + " times");
+            // Straight away, so its number stays close to the stick's.
+            todo.push_front(std::move(f));
+            continue;
+        }
+        if (r.status != SERIAL_CMD_OK)
+        {
+            if (++resyncs > PICSTICK_LINK_RETRIES)
+                throw std::runtime_error(what + " failed: " + (r.status.empty() ? "no reply" : r.status));
+            link.abort("resyncing");
+            inflight.clear();
+            resync();
+
+            size_t at = resume_point(p);
+            if (at < first)
+                throw std::runtime_error(what + " failed: session lost");
+            todo.clear();
+            for (size_t i = at; i < rows.size(); i++)
+            {
+                todo.push_back({i, next_seq++, i < sent ? 1u : 0u, {}});
+            }
+            continue;
+        }
+        check(r, what.c_str());
+    }
+}
+
+size_t
+client::verify (const plan &p)
+{
+    size_t errors = 0;
+
+    if (!p.rows.empty())
+    {
+        uint32_t end = p.rows.back().address + PICSTICK_ROW_WORDS;
+        std::vector<uint16_t> expected(end, PICSTICK_BLANK);
+        for (const row &r : p.rows)
+        {
+            std::copy(r.words, r.words + PICSTICK_ROW_WORDS, expected.begin() + r.address);
+        }
+
+        std::vector<uint16_t> words = dump(0, end);
+        for (uint32_t a = 0; a < end; a++)
+        {
+            if (words[a] != expected[a])
+                errors++;
+        }
+    }
+
+    for (const auto &w : p.config)
+    {
+        if (read(w.first) != w.second)
+            errors++;
+    }
+    return errors;
+}
+
+}
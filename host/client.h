@@ -0,0 +1,144 @@
+/** @file client.h
+ *
+ * The picstick protocol on top of the transport, and programming and
+ * verifying a planned image with it.
+ *
+*/
+
+#ifndef _picstick_client_h_
+#define _picstick_client_h_
+
+#include <stdint.h>
+
+#include <future>
+#include <string>
+#include <vector>
+
+#include "planner.h"
+#include "transport.h"
+
+// How long the stick waits for the rest of a command before it answers
+// TIMEOUT: (UART_RX_TIMEOUT_MS in the firmware), and how long to give it on
+// top of that in resync().
+#define PICSTICK_RX_TIMEOUT_MS  20
+#define PICSTICK_RESYNC_MS      10
+
+// The ERASE address for bulk erasing everything, or only program memory.
+#define PICSTICK_ERASE_ALL      0xFFFF
+#define PICSTICK_ERASE_FLASH    0xFFFE
+// Words an ERASE of a row address erases, the PIC's own row.
+#define PICSTICK_ERASE_WORDS    32
+
+namespace picstick {
+
+// How often a frame is sent again before giving up, and how often the link
+// is resynced in one programming run.
+#define PICSTICK_FRAME_RETRIES  3
+#define PICSTICK_LINK_RETRIES   3
+
+/** Encode a row as a FROW frame, with sequence number 0. */
+request     row_request (const row &r);
+
+/** Set the sequence number of a FROW frame, and its CRC with it. */
+void        set_frame_seq (request &frame, uint8_t seq);
+
+/** Encode all the rows of a plan. */
+std::vector<request> row_requests (const plan &p);
+
+/** Encode a BATCH operation, see SERIAL_BATCH_* in commands.h. */
+std::vector<uint8_t> batch_op (uint8_t op, uint16_t arg, std::initializer_list<uint8_t> data = {});
+
+/** How far a programming session on the stick got: the token it was begun
+ *  with, and the number of rows written since with a CRC over them. */
+struct session
+{
+    uint16_t    token = 0;
+    uint16_t    rows = 0;
+    uint16_t    crc = 0;
+    uint16_t    last_crc = 0;   // Before the last row
+};
+
+/** The session token for a plan, a CRC over all of it. */
+uint16_t    session_token (const plan &p);
+
+/** The CRC the stick computes over the first rows of a plan. */
+uint16_t    session_crc (const plan &p, size_t rows);
+
+class client
+{
+public:
+    /** Open the stick. Throws std::runtime_error, as do all the commands
+     *  below when the stick doesn't reply OK. */
+    client (const std::string &port, unsigned baud = PICSTICK_BAUD, unsigned window = 1);
+
+    void        hello (void);
+    void        bye (void);
+
+    /** Get a stick that may still be halfway through a command from a host
+     *  that went away back to reading commands, then say hello. */
+    void        resync (void);
+
+    /** Enter and exit programming mode. */
+    void        start (void);
+    void        stop (void);
+
+    /** After a failure, get the stick back to reading commands, leave
+     *  programming mode and say goodbye, as far as it still answers.
+     *  Doesn't throw. */
+    void        abandon (void);
+
+    void        erase (uint16_t address);
+    void        write_word (uint16_t address, uint16_t word);
+    uint16_t    read (uint16_t address);
+
+    /** Run operations from batch_op(), as many to a BATCH as the stick
+     *  holds at once. Throws naming the first one that failed. */
+    void        batch (const std::vector<std::vector<uint8_t>> &ops);
+
+    /** Begin a programming session, or ask how far the last one got. */
+    session     session_begin (uint16_t token);
+    session     session_query (void);
+    session     session_drop (void);
+
+    /** How many rows of the plan the stick already wrote in a session that
+     *  was interrupted, or 0 if it has to start over. A last row that was
+     *  cut short is erased and dropped from the session, to be written
+     *  again. Needs programming mode. */
+    size_t      resume_point (const plan &p);
+
+    /** Read count words starting at address, run-length encoded on the wire. */
+    std::vector<uint16_t> dump (uint16_t address, uint32_t count);
+
+    /** Erase and write a plan in a new session, with the rows pipelined
+     *  through the transport's window and the configuration words in a
+     *  batch. */
+    void        program (const plan &p, bool erase = true);
+
+    /** The same, with the rows of the plan already encoded by row_request(),
+     *  so one encoding can be shared by many sticks. With first from
+     *  resume_point(), carries on with the interrupted session instead.
+     *  Frames the stick NAKs are sent again, and if the link breaks down
+     *  it is resynced and the session picked up again at resume_point(),
+     *  with every row after that sent again. */
+    void        program (const plan &p, const std::vector<request> &rows, bool erase = true,
+                         size_t first = 0);
+
+    /** Read back everything from address 0 up to the last row of the plan,
+     *  and its configuration words. Returns how many words differ. */
+    size_t      verify (const plan &p);
+
+    transport   link;
+
+    // Frames sent again after a NAK or a resync.
+    size_t      retransmits = 0;
+
+private:
+    response    call (request req);
+    void        write_rows (const plan &p, const std::vector<request> &rows, size_t first);
+
+    uint8_t     next_seq = 0;
+};
+
+}
+
+#endif
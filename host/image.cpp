@@ -0,0 +1,181 @@
+/** @file image.cpp
+ *
+ * Program memory images loaded from Intel HEX or raw binary files.
+ *
+*/
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <stdexcept>
+
+#include "image.h"
+
+namespace picstick {
+
+// PIC16 program memory words are 14 bits wide.
+#define IMAGE_WORD_MASK 0x3FFF
+
+#define HEX_DATA        0x00
+#define HEX_EOF         0x01
+#define HEX_SEGMENT     0x02
+#define HEX_LINEAR      0x04
+
+
+/** A read-only memory mapping of a whole file. */
+class mapped_file
+{
+public:
+    explicit mapped_file (const std::string &path)
+    {
+        fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("can't open " + path);
+
+        struct stat st;
+        if (fstat(fd, &st) < 0)
+        {
+            close(fd);
+            throw std::runtime_error("can't stat " + path);
+        }
+        size = st.st_size;
+        if (size == 0)
+            return;
+
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            close(fd);
+            throw std::runtime_error("can't map " + path);
+        }
+    }
+
+    ~mapped_file ()
+    {
+        if (data && data != MAP_FAILED)
+            munmap(data, size);
+        close(fd);
+    }
+
+    int     fd = -1;
+    void   *data = NULL;
+    size_t  size = 0;
+};
+
+
+static int
+hex_digit (char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+image
+image::load (const std::string &path)
+{
+    mapped_file file(path);
+
+    if (path.size() > 4 && path.compare(path.size() - 4, 4, ".bin") == 0)
+        return parse_bin((const uint8_t *)file.data, file.size);
+    return parse_hex((const char *)file.data, file.size);
+}
+
+image
+image::parse_hex (const char *data, size_t len)
+{
+    image img;
+    uint32_t base = 0;
+    size_t pos = 0;
+    unsigned line = 0;
+
+    // Bytes are addressed individually, low byte of each word first.
+    std::map<uint32_t, uint16_t> &words = img.words;
+    auto put = [&](uint32_t address, uint8_t byte) {
+        auto w = words.emplace(address / 2, 0xFFFF).first;
+        if (address & 1)
+            w->second = (w->second & 0x00FF) | (byte << 8);
+        else
+            w->second = (w->second & 0xFF00) | byte;
+    };
+
+    while (pos < len)
+    {
+        if (data[pos++] != ':')
+            continue;
+        line++;
+
+        uint8_t rec[5 + 255];
+        size_t n = 0;
+        while (pos + 1 < len && n < sizeof(rec))
+        {
+            int hi = hex_digit(data[pos]);
+            int lo = hex_digit(data[pos + 1]);
+            if (hi < 0 || lo < 0)
+                break;
+            rec[n++] = (hi << 4) | lo;
+            pos += 2;
+        }
+
+        if (n < 5 || n != (size_t)rec[0] + 5)
+            throw std::runtime_error("bad hex record on line " + std::to_string(line));
+
+        uint8_t sum = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            sum += rec[i];
+        }
+        if (sum != 0)
+            throw std::runtime_error("bad hex checksum on line " + std::to_string(line));
+
+        uint8_t count = rec[0];
+        uint32_t offset = (rec[1] << 8) | rec[2];
+        const uint8_t *payload = rec + 4;
+
+        switch (rec[3])
+        {
+        case HEX_DATA:
+            for (uint8_t i = 0; i < count; i++)
+            {
+                put(base + offset + i, payload[i]);
+            }
+            break;
+        case HEX_EOF:
+            pos = len;
+            break;
+        case HEX_SEGMENT:
+            base = ((payload[0] << 8) | payload[1]) << 4;
+            break;
+        case HEX_LINEAR:
+            base = (uint32_t)((payload[0] << 8) | payload[1]) << 16;
+            break;
+        default:
+            break;
+        }
+    }
+
+    for (auto &w : words)
+    {
+        w.second &= IMAGE_WORD_MASK;
+    }
+    return img;
+}
+
+image
+image::parse_bin (const uint8_t *data, size_t len)
+{
+    image img;
+    for (size_t i = 0; i + 1 < len; i += 2)
+    {
+        img.words[i / 2] = (data[i] | (data[i + 1] << 8)) & IMAGE_WORD_MASK;
+    }
+    return img;
+}
+
+}
@@ -0,0 +1,38 @@
+/** @file image.h
+ *
+ * Program memory images loaded from Intel HEX or raw binary files.
+ *
+*/
+
+#ifndef _picstick_image_h_
+#define _picstick_image_h_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <string>
+
+namespace picstick {
+
+/** The words of a program memory image, by word address. */
+class image
+{
+public:
+    /** Load a file, memory-mapped. Names ending in .bin are raw little endian
+     *  words from address 0, anything else is Intel HEX.
+     *  Throws std::runtime_error. */
+    static image    load (const std::string &path);
+
+    /** Parse Intel HEX with byte addresses, as written by XC8/MPASM. */
+    static image    parse_hex (const char *data, size_t len);
+
+    /** Parse raw little endian words starting at address 0. */
+    static image    parse_bin (const uint8_t *data, size_t len);
+
+    std::map<uint32_t, uint16_t> words;
+};
+
+}
+
+#endif
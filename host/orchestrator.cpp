@@ -0,0 +1,157 @@
+/** @file orchestrator.cpp
+ *
+ * Programming several picsticks on one host in parallel.
+ *
+*/
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <thread>
+
+#include "orchestrator.h"
+#include "client.h"
+
+namespace picstick {
+
+#define SYSFS_TTY   "/sys/class/tty"
+
+// Size of the BATCH writing the configuration words: "BATCH:" length, then
+// a 'W' address word operation for each.
+#define BATCH_REQUEST_BYTES 8
+#define BATCH_WORD_BYTES    5
+
+static std::string
+read_line (const std::string &path)
+{
+    std::ifstream f(path);
+    std::string line;
+    std::getline(f, line);
+    return line;
+}
+
+std::vector<std::string>
+discover_sticks (void)
+{
+    std::vector<std::string> ports;
+
+    DIR *dir = opendir(SYSFS_TTY);
+    if (!dir)
+        return ports;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        std::string name = entry->d_name;
+        if (name.compare(0, 6, "ttyUSB") != 0)
+            continue;
+
+        // The USB device holding the IDs is a few levels up from the tty.
+        char real[PATH_MAX];
+        std::string device = std::string(SYSFS_TTY) + "/" + name + "/device";
+        if (!realpath(device.c_str(), real))
+            continue;
+
+        std::string path = real;
+        for (int up = 0; up < 4 && path.size() > 1; up++)
+        {
+            std::string vendor = read_line(path + "/idVendor");
+            if (!vendor.empty())
+            {
+                if (vendor == PICSTICK_USB_VENDOR &&
+                    read_line(path + "/idProduct") == PICSTICK_USB_PRODUCT)
+                    ports.push_back("/dev/" + name);
+                break;
+            }
+            path = path.substr(0, path.rfind('/'));
+        }
+    }
+    closedir(dir);
+
+    std::sort(ports.begin(), ports.end());
+    return ports;
+}
+
+static double
+seconds_since (std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void
+program_one (const plan &p, const std::vector<request> &rows,
+             const stick_options &options, stick_result &result)
+{
+    try
+    {
+        client stick(result.port, options.baud, options.window);
+        try
+        {
+            stick.hello();
+            stick.start();
+
+            auto start = std::chrono::steady_clock::now();
+            stick.program(p, rows, options.erase);
+            result.program_s = seconds_since(start);
+
+            if (options.verify)
+            {
+                start = std::chrono::steady_clock::now();
+                result.mismatches = stick.verify(p);
+                result.verify_s = seconds_since(start);
+            }
+
+            stick.stop();
+            stick.bye();
+        }
+        catch (const std::exception &)
+        {
+            // Don't leave the target held in programming mode.
+            stick.abandon();
+            throw;
+        }
+
+        result.ok = result.mismatches == 0;
+        if (!result.ok)
+            result.error = std::to_string(result.mismatches) + " words failed to verify";
+    }
+    catch (const std::exception &e)
+    {
+        result.error = e.what();
+    }
+}
+
+std::vector<stick_result>
+program_all (const plan &p, const std::vector<std::string> &ports,
+             const stick_options &options)
+{
+    // Encode once, every worker sends the same rows.
+    const std::vector<request> rows = row_requests(p);
+
+    size_t bytes = p.config.empty() ? 0 : BATCH_REQUEST_BYTES + p.config.size() * BATCH_WORD_BYTES;
+    for (const request &r : rows)
+    {
+        bytes += r.bytes.size();
+    }
+
+    std::vector<stick_result> results(ports.size());
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < ports.size(); i++)
+    {
+        results[i].port = ports[i];
+        results[i].bytes = bytes;
+        workers.emplace_back(program_one, std::cref(p), std::cref(rows),
+                             std::cref(options), std::ref(results[i]));
+    }
+    for (std::thread &t : workers)
+    {
+        t.join();
+    }
+    return results;
+}
+
+}
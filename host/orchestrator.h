@@ -0,0 +1,55 @@
+/** @file orchestrator.h
+ *
+ * Programming several picsticks on one host in parallel. The image is
+ * planned and its ROW commands encoded once, then one worker thread per
+ * stick programs and verifies its own PIC.
+ *
+*/
+
+#ifndef _picstick_orchestrator_h_
+#define _picstick_orchestrator_h_
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+#include "planner.h"
+#include "transport.h"
+
+// USB IDs of the CH340 bridge on the picstick.
+#define PICSTICK_USB_VENDOR     "1a86"
+#define PICSTICK_USB_PRODUCT    "7523"
+
+namespace picstick {
+
+/** Find the serial ports of all connected CH340s, sorted by name. */
+std::vector<std::string> discover_sticks (void);
+
+struct stick_options
+{
+    unsigned    baud = PICSTICK_BAUD;
+    unsigned    window = 1;
+    bool        erase = true;
+    bool        verify = true;
+};
+
+/** How programming one stick went. */
+struct stick_result
+{
+    std::string port;
+    bool        ok = false;
+    std::string error;
+    size_t      mismatches = 0;
+    double      program_s = 0;
+    double      verify_s = 0;
+    size_t      bytes = 0;      // ROW and WORD command bytes sent
+};
+
+/** Program the plan into every port in parallel, one worker per port. */
+std::vector<stick_result> program_all (const plan &p, const std::vector<std::string> &ports,
+                                       const stick_options &options);
+
+}
+
+#endif
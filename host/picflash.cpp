@@ -0,0 +1,123 @@
+/** @file picflash.cpp
+ *
+ * picflash - Program an image into a PIC through the picstick, using the
+ * host library.
+ *
+ *   picflash [-p port] [-b baud] [-w window] [-n] [-r] [-V] image.hex
+ *
+ *   -n  don't erase first
+ *   -r  resume an interrupted run of the same image, if the stick has it
+ *   -V  don't verify
+ *
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <stdexcept>
+
+#include "client.h"
+#include "image.h"
+#include "planner.h"
+
+#define PICFLASH_PORT   "/dev/ttyUSB0"
+
+using namespace picstick;
+
+static double
+seconds_since (std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void
+usage (void)
+{
+    fprintf(stderr, "usage: picflash [-p port] [-b baud] [-w window] [-n] [-r] [-V] image.hex\n");
+}
+
+int
+main (int argc, char **argv)
+{
+    const char *port = PICFLASH_PORT;
+    unsigned baud = PICSTICK_BAUD;
+    unsigned window = 1;
+    bool erase = true;
+    bool resume = false;
+    bool verify = true;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:b:w:nrVh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p': port = optarg; break;
+        case 'b': baud = strtoul(optarg, NULL, 10); break;
+        case 'w': window = strtoul(optarg, NULL, 10); break;
+        case 'n': erase = false; break;
+        case 'r': resume = true; break;
+        case 'V': verify = false; break;
+        default:
+            usage();
+            return 2;
+        }
+    }
+    if (optind != argc - 1)
+    {
+        usage();
+        return 2;
+    }
+
+    try
+    {
+        image img = image::load(argv[optind]);
+        plan p = plan_image(img);
+        printf("%s: %zu words, %zu rows, %zu config words\n",
+               argv[optind], img.words.size(), p.rows.size(), p.config.size());
+
+        client stick(port, baud, window);
+        size_t errors = 0;
+        try
+        {
+            if (resume)
+                stick.resync();
+            else
+                stick.hello();
+            stick.start();
+
+            size_t first = resume ? stick.resume_point(p) : 0;
+            if (first)
+                printf("resuming after %zu of %zu rows\n", first, p.rows.size());
+
+            auto start = std::chrono::steady_clock::now();
+            stick.program(p, row_requests(p), erase, first);
+            printf("programmed in %.3f s\n", seconds_since(start));
+            if (stick.retransmits)
+                printf("%zu rows sent again\n", stick.retransmits);
+
+            if (verify)
+            {
+                start = std::chrono::steady_clock::now();
+                errors = stick.verify(p);
+                printf("verified in %.3f s, %zu mismatched words\n", seconds_since(start), errors);
+            }
+
+            stick.stop();
+            stick.bye();
+        }
+        catch (const std::exception &)
+        {
+            // Don't leave the target held in programming mode.
+            stick.abandon();
+            throw;
+        }
+        return errors ? 1 : 0;
+    }
+    catch (const std::exception &e)
+    {
+        fprintf(stderr, "picflash: %s\n", e.what());
+        return 1;
+    }
+}
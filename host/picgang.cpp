@@ -0,0 +1,100 @@
+/** @file picgang.cpp
+ *
+ * picgang - Program the same image through every connected picstick at
+ * once, and report the throughput and result of each.
+ *
+ *   picgang [-p port]... [-b baud] [-w window] [-n] [-V] image.hex
+ *
+ * Without -p, all CH340 serial ports are used.
+ *
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <stdexcept>
+
+#include "image.h"
+#include "orchestrator.h"
+#include "planner.h"
+
+using namespace picstick;
+
+static void
+usage (void)
+{
+    fprintf(stderr, "usage: picgang [-p port]... [-b baud] [-w window] [-n] [-V] image.hex\n");
+}
+
+int
+main (int argc, char **argv)
+{
+    std::vector<std::string> ports;
+    stick_options options;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:b:w:nVh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p': ports.push_back(optarg); break;
+        case 'b': options.baud = strtoul(optarg, NULL, 10); break;
+        case 'w': options.window = strtoul(optarg, NULL, 10); break;
+        case 'n': options.erase = false; break;
+        case 'V': options.verify = false; break;
+        default:
+            usage();
+            return 2;
+        }
+    }
+    if (optind != argc - 1)
+    {
+        usage();
+        return 2;
+    }
+
+    if (ports.empty())
+        ports = discover_sticks();
+    if (ports.empty())
+    {
+        fprintf(stderr, "picgang: no picsticks found\n");
+        return 1;
+    }
+
+    plan p;
+    try
+    {
+        p = plan_image(image::load(argv[optind]));
+    }
+    catch (const std::exception &e)
+    {
+        fprintf(stderr, "picgang: %s\n", e.what());
+        return 1;
+    }
+    printf("%s: %zu rows, %zu config words, %zu sticks\n",
+           argv[optind], p.rows.size(), p.config.size(), ports.size());
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<stick_result> results = program_all(p, ports, options);
+    double total_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    int failed = 0;
+    size_t bytes = 0;
+    for (const stick_result &r : results)
+    {
+        printf("%-16s %-4s program %7.3f s %7.1f kB/s  verify %7.3f s  %s\n",
+               r.port.c_str(), r.ok ? "ok" : "FAIL", r.program_s,
+               r.program_s > 0 ? r.bytes / r.program_s / 1000 : 0.0,
+               r.verify_s, r.error.c_str());
+        if (!r.ok)
+            failed++;
+        else
+            bytes += r.bytes;
+    }
+    printf("%zu/%zu sticks programmed in %.3f s, %.1f kB/s total\n",
+           results.size() - failed, results.size(), total_s, bytes / total_s / 1000);
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,60 @@
+/** @file planner.cpp
+ *
+ * Plans an image into the ROW and WORD commands that program it.
+ *
+*/
+
+#include "planner.h"
+
+namespace picstick {
+
+static bool
+row_blank (const row &r)
+{
+    for (uint16_t w : r.words)
+    {
+        if (w != PICSTICK_BLANK)
+            return false;
+    }
+    return true;
+}
+
+plan
+plan_image (const image &img)
+{
+    plan p;
+
+    // The words are sorted by address, so each row is filled in one go.
+    for (const auto &w : img.words)
+    {
+        if (w.first >= PICSTICK_CONFIG_BASE)
+        {
+            if (w.second != PICSTICK_BLANK)
+                p.config.push_back({(uint16_t)w.first, w.second});
+            continue;
+        }
+
+        uint16_t address = w.first & ~(PICSTICK_ROW_WORDS - 1);
+        if (p.rows.empty() || p.rows.back().address != address)
+        {
+            if (!p.rows.empty() && row_blank(p.rows.back()))
+                p.rows.pop_back();
+
+            row r;
+            r.address = address;
+            for (uint16_t &word : r.words)
+            {
+                word = PICSTICK_BLANK;
+            }
+            p.rows.push_back(r);
+        }
+        p.rows.back().words[w.first - address] = w.second;
+    }
+
+    if (!p.rows.empty() && row_blank(p.rows.back()))
+        p.rows.pop_back();
+
+    return p;
+}
+
+}
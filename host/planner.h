@@ -0,0 +1,46 @@
+/** @file planner.h
+ *
+ * Plans an image into the ROW and WORD commands that program it.
+ *
+*/
+
+#ifndef _picstick_planner_h_
+#define _picstick_planner_h_
+
+#include <stdint.h>
+
+#include <utility>
+#include <vector>
+
+#include "image.h"
+
+// Words per ROW command, and where configuration memory starts.
+#define PICSTICK_ROW_WORDS      64
+#define PICSTICK_CONFIG_BASE    0x8000
+#define PICSTICK_BLANK          0x3FFF
+
+namespace picstick {
+
+/** One aligned row of program memory. */
+struct row
+{
+    uint16_t    address;
+    uint16_t    words[PICSTICK_ROW_WORDS];
+};
+
+struct plan
+{
+    /** Rows to write, in address order. Blank rows are left out, they are
+     *  already blank after an erase. */
+    std::vector<row>    rows;
+
+    /** Configuration words (address, word), written one at a time. */
+    std::vector<std::pair<uint16_t, uint16_t>> config;
+};
+
+/** Coalesce the words of an image into rows and configuration writes. */
+plan    plan_image (const image &img);
+
+}
+
+#endif
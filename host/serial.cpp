@@ -0,0 +1,50 @@
+/** @file serial.cpp
+ *
+ * Opening the stick's serial port. This uses the Linux termios2 interface
+ * directly, which can't be mixed with <termios.h> in the same file.
+ *
+*/
+
+#include <asm/termbits.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "serial.h"
+
+namespace picstick {
+
+int
+serial_open (const std::string &port, unsigned baud)
+{
+    int fd = open(port.c_str(), O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    struct termios2 tio;
+    if (ioctl(fd, TCGETS2, &tio) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    // Raw 8N1, no flow control.
+    tio.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON | IXOFF);
+    tio.c_oflag &= ~OPOST;
+    tio.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    tio.c_cflag &= ~(CSIZE | PARENB | CSTOPB | CRTSCTS | CBAUD);
+    tio.c_cflag |= CS8 | CREAD | CLOCAL | BOTHER;
+    tio.c_ispeed = baud;
+    tio.c_ospeed = baud;
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+
+    if (ioctl(fd, TCSETS2, &tio) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+}
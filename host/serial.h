@@ -0,0 +1,20 @@
+/** @file serial.h
+ *
+ * Opening the stick's serial port.
+ *
+*/
+
+#ifndef _picstick_serial_h_
+#define _picstick_serial_h_
+
+#include <string>
+
+namespace picstick {
+
+/** Open a serial port raw, 8N1, at any baud rate (76800 has no Bxxx
+ *  constant on Linux). Returns the file descriptor, or -1 with errno set. */
+int     serial_open (const std::string &port, unsigned baud);
+
+}
+
+#endif
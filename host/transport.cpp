@@ -0,0 +1,227 @@
+/** @file transport.cpp
+ *
+ * Asynchronous transport for the picstick protocol.
+ *
+*/
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <stdexcept>
+
+#include "transport.h"
+#include "serial.h"
+
+namespace picstick {
+
+// Longest status the stick sends ("UNKOWN") with some slack.
+#define TRANSPORT_MAX_STATUS    8
+#define TRANSPORT_POLL_MS       50
+#define TRANSPORT_TO_SEP        SIZE_MAX    // Expect data up to the next separator
+
+
+transport::transport (const std::string &port, unsigned baud, unsigned window)
+    : baud(baud), window(window ? window : 1)
+{
+    fd = serial_open(port, baud);
+    if (fd < 0)
+        throw std::runtime_error("can't open " + port + ": " + strerror(errno));
+
+    thread = std::thread(&transport::reader, this);
+}
+
+transport::~transport ()
+{
+    stop = true;
+    thread.join();
+    abort("transport closed");
+    close(fd);
+}
+
+std::future<response>
+transport::send (request req)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    if (!changed.wait_for(guard, std::chrono::milliseconds(timeout_ms),
+                          [&] { return !flushing; }))
+        throw std::runtime_error("stick won't stop sending");
+    changed.wait(guard, [&] { return inflight.size() < window; });
+
+    inflight.push_back({std::move(req), std::promise<response>()});
+    pending &p = inflight.back();
+    std::future<response> reply = p.promise.get_future();
+
+    // Write while holding the lock so requests go out in queue order.
+    write_all(p.req.bytes);
+    return reply;
+}
+
+void
+transport::write (const std::vector<uint8_t> &bytes)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    write_all(bytes);
+}
+
+void
+transport::write_all (const std::vector<uint8_t> &bytes)
+{
+    size_t done = 0;
+    while (done < bytes.size())
+    {
+        ssize_t n = ::write(fd, bytes.data() + done, bytes.size() - done);
+        if (n < 0 && errno != EINTR && errno != EAGAIN)
+            throw std::runtime_error(std::string("write: ") + strerror(errno));
+        if (n > 0)
+            done += n;
+    }
+}
+
+void
+transport::drain (void)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    changed.wait(guard, [&] { return inflight.empty(); });
+}
+
+void
+transport::abort (const std::string &why)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (pending &p : inflight)
+    {
+        p.promise.set_exception(std::make_exception_ptr(std::runtime_error(why)));
+    }
+    inflight.clear();
+    reply = response();
+    in_status = true;
+    flushing = true;
+    quiet_since = std::chrono::steady_clock::now();
+    changed.notify_all();
+}
+
+bool
+transport::parse (uint8_t byte)
+{
+    // Called with the lock held and a request in flight. Returns true once
+    // the reply to the oldest request is complete.
+    const request &req = inflight.front().req;
+
+    if (in_status)
+    {
+        if (byte != ':')
+        {
+            reply.status.push_back(byte);
+            if (reply.status.size() > TRANSPORT_MAX_STATUS)
+                throw std::runtime_error("garbled reply");
+            return false;
+        }
+        in_status = false;
+
+        if (reply.status == req.ok)
+        {
+            if (req.ok_feed)
+                return false;
+            expected = req.ok_len;
+        }
+        else if (reply.status == "TIMEOUT")
+        {
+            // The stick gave up waiting for the rest of the request.
+            expected = 0;
+        }
+        else if (reply.status == "UNKOWN")
+        {
+            // The stick echoes the command name back as it got it, which
+            // need not be what was sent, up to a separator.
+            expected = TRANSPORT_TO_SEP;
+            return false;
+        }
+        else
+        {
+            expected = req.error_len;
+        }
+        return expected == 0;
+    }
+
+    if (expected == TRANSPORT_TO_SEP)
+    {
+        if (byte == ':')
+            return true;
+        reply.data.push_back(byte);
+        return false;
+    }
+
+    reply.data.push_back(byte);
+    if (reply.status == req.ok && req.ok_feed)
+        return req.ok_feed(byte);
+    return reply.data.size() == expected;
+}
+
+void
+transport::reader (void)
+{
+    unsigned idle_ms = 0;
+
+    while (!stop)
+    {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, TRANSPORT_POLL_MS);
+
+        uint8_t buf[512];
+        ssize_t n = 0;
+        if (ready > 0 && (pfd.revents & POLLIN))
+            n = read(fd, buf, sizeof(buf));
+
+        std::unique_lock<std::mutex> guard(lock);
+        if (flushing && n > 0)
+            quiet_since = std::chrono::steady_clock::now();
+        else if (flushing && std::chrono::steady_clock::now() - quiet_since >=
+                 std::chrono::milliseconds(TRANSPORT_POLL_MS))
+        {
+            // Quiet for a whole poll period, the aborted replies are over.
+            flushing = false;
+            changed.notify_all();
+        }
+        if (n <= 0)
+        {
+            // Only time out while waiting for a reply.
+            idle_ms = inflight.empty() ? 0 : idle_ms + TRANSPORT_POLL_MS;
+            if (idle_ms >= timeout_ms)
+            {
+                guard.unlock();
+                abort("stick stopped answering");
+                idle_ms = 0;
+            }
+            continue;
+        }
+        idle_ms = 0;
+
+        try
+        {
+            for (ssize_t i = 0; i < n; i++)
+            {
+                // Anything arriving with nothing in flight is stray, or
+                // the rest of an aborted reply.
+                if (inflight.empty() || flushing)
+                    continue;
+                if (!parse(buf[i]))
+                    continue;
+
+                inflight.front().promise.set_value(std::move(reply));
+                inflight.pop_front();
+                reply = response();
+                in_status = true;
+                changed.notify_all();
+            }
+        }
+        catch (const std::exception &e)
+        {
+            guard.unlock();
+            abort(e.what());
+        }
+    }
+}
+
+}
@@ -0,0 +1,122 @@
+/** @file transport.h
+ *
+ * Asynchronous transport for the picstick protocol. Requests are written
+ * as soon as the window allows, and a reader thread parses the replies and
+ * completes them in order.
+ *
+ * How many requests can safely be in flight depends on the stick: the
+ * firmware only buffers a few received bytes while it is busy programming,
+ * so the default window is one request.
+ *
+*/
+
+#ifndef _picstick_transport_h_
+#define _picstick_transport_h_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define PICSTICK_BAUD           76800
+#define PICSTICK_TIMEOUT_MS     2000
+
+namespace picstick {
+
+/** A command and the shape of its reply. */
+struct request
+{
+    std::vector<uint8_t>    bytes;
+
+    /** Status of a successful reply, and how many bytes follow it. */
+    std::string             ok = "OK";
+    size_t                  ok_len = 0;
+
+    /** For replies of variable length: called with each byte after the
+     *  status, returns true on the last one. Overrides ok_len. */
+    std::function<bool (uint8_t)> ok_feed;
+
+    /** How many bytes follow an ERROR: reply. */
+    size_t                  error_len = 0;
+};
+
+struct response
+{
+    std::string             status;
+    std::vector<uint8_t>    data;
+};
+
+class transport
+{
+public:
+    /** Open the stick's serial port. Throws std::runtime_error. */
+    transport (const std::string &port, unsigned baud = PICSTICK_BAUD, unsigned window = 1);
+    ~transport ();
+
+    transport (const transport &) = delete;
+    transport &operator= (const transport &) = delete;
+
+    /** Send a request, waiting while the window is full or an abort is
+     *  being flushed. The future throws std::runtime_error if the stick
+     *  stops answering. */
+    std::future<response>   send (request req);
+
+    /** Wait until every request in flight has its reply. */
+    void                    drain (void);
+
+    /** Fail every request in flight with why. Whatever the stick sends
+     *  until the line has been quiet for a poll period (50 ms) is dropped,
+     *  and send() waits for that. A reply that comes later still is taken
+     *  for the next request's, so follow an abort with a request only its
+     *  own reply satisfies, as client::resync() does with HELLO. */
+    void                    abort (const std::string &why);
+
+    /** Write bytes that don't get a reply of their own. Anything the stick
+     *  sends while no request is in flight is dropped. */
+    void                    write (const std::vector<uint8_t> &bytes);
+
+    unsigned                baud;
+    unsigned                window;
+    unsigned                timeout_ms = PICSTICK_TIMEOUT_MS;
+
+private:
+    struct pending
+    {
+        request                 req;
+        std::promise<response>  promise;
+    };
+
+    void        reader (void);
+    void        write_all (const std::vector<uint8_t> &bytes);
+    bool        parse (uint8_t byte);
+
+    int                         fd;
+    std::thread                 thread;
+    std::atomic<bool>           stop{false};
+    std::mutex                  lock;
+    std::condition_variable     changed;
+    std::deque<pending>         inflight;
+
+    // Dropping replies to aborted requests, until the line has been quiet
+    // since quiet_since for a poll period.
+    bool                        flushing = false;
+    std::chrono::steady_clock::time_point quiet_since;
+
+    // Reply being parsed, for the oldest request in flight.
+    response                    reply;
+    bool                        in_status = true;
+    size_t                      expected = 0;
+};
+
+}
+
+#endif
@@ -0,0 +1,292 @@
+/** @file icsptrace.cpp
+ *
+ * icsptrace - Run the picstick firmware against a simulated PIC, record the
+ * ICSP and UART lines to a VCD trace, and check every ICSP edge against the
+ * timing minima of a PIC family.
+ *
+ *   icsptrace [-f family] [-t ckh,ckl,dly] [-i session.bin] [-r replies.bin]
+ *             [-o trace.vcd]
+ *   icsptrace [-f family] -c trace.vcd
+ *   icsptrace -l
+ *
+ * The session is the raw byte stream a host would send to the stick. A short
+ * built-in session (erase, write and verify a row) is used if none is given.
+ * Exits with 1 if any timing rule was broken.
+ *
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "sim.h"
+#include "sim_uart.h"
+#include "pic.h"
+#include "vcd.h"
+
+#include "uuart.h"
+#include "icsp.h"
+#include "commands.h"
+
+
+/** Feeds a fixed session to the firmware, one byte whenever it asks. */
+class script_host : public sim_uart_host
+{
+public:
+    explicit script_host (const std::vector<uint8_t> &bytes) : bytes(bytes) {}
+
+    bool rx (uint8_t &byte, uint64_t &arrival_ns) override
+    {
+        if (next == bytes.size())
+            return false;
+        byte = bytes[next++];
+
+        // The byte starts on the wire as soon as the line is idle.
+        uint64_t now = sim_now_ns();
+        rx_free = ((rx_free > now) ? rx_free : now) + SIM_UART_FRAME_NS;
+        arrival_ns = rx_free;
+        return true;
+    }
+
+    bool rx_available (void) override { return next < bytes.size(); }
+
+    // The session never pauses, the next byte is always on its way.
+    bool rx_wait (uint64_t deadline_ns) override { (void)deadline_ns; return true; }
+
+    // Bytes only go out when asked for, none are ever waiting.
+    void rx_flush (void) override {}
+
+    void tx (uint8_t byte, uint64_t done_ns) override
+    {
+        (void)done_ns;
+        replies.push_back(byte);
+    }
+
+    std::vector<uint8_t> replies;
+
+private:
+    const std::vector<uint8_t> &bytes;
+    size_t next = 0;
+    uint64_t rx_free = 0;
+};
+
+
+static void
+append (std::vector<uint8_t> &v, const char *s)
+{
+    v.insert(v.end(), s, s + strlen(s));
+}
+
+static std::vector<uint8_t>
+default_session (void)
+{
+    std::vector<uint8_t> s;
+
+    append(s, "HELLO:START:");
+    append(s, "ERASE:");
+    s.push_back(0xFF);
+    s.push_back(0xFE);
+
+    append(s, "ROW:");
+    s.push_back(0x00);
+    s.push_back(0x00);
+    s.push_back(':');
+    for (int i = 0; i < 64; i++)
+    {
+        s.push_back((i >> 8) & 0x3F);
+        s.push_back(i & 0xFF);
+    }
+
+    append(s, "READ:");
+    s.push_back(0x00);
+    s.push_back(0x01);
+
+    append(s, "STOP:BYE:");
+    return s;
+}
+
+static int
+read_file (const char *path, std::vector<uint8_t> &out)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return -1;
+    int c;
+    while ((c = fgetc(f)) != EOF)
+    {
+        out.push_back(c);
+    }
+    fclose(f);
+    return 0;
+}
+
+static int
+write_file (const char *path, const std::vector<uint8_t> &data)
+{
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        return -1;
+    size_t n = fwrite(data.data(), 1, data.size(), f);
+    return (fclose(f) == 0 && n == data.size()) ? 0 : -1;
+}
+
+static int
+report (const pic_target &pic)
+{
+    for (const pic_violation &v : pic.violations)
+    {
+        printf("%14.3f us  %-12s %-10s", v.time_ns / 1000.0, v.edge.c_str(), v.rule.c_str());
+        if (v.required_ns)
+            printf(" requires %llu ns, got %llu ns",
+                   (unsigned long long)v.required_ns, (unsigned long long)v.actual_ns);
+        printf("\n");
+    }
+    printf("%llu edges checked against %s, %zu violations\n",
+           (unsigned long long)pic.edges, pic.family.name, pic.violations.size());
+    return pic.violations.empty() ? 0 : 1;
+}
+
+static int
+check_trace (const pic_family &family, const char *path)
+{
+    pic_target pic(family);
+
+    int err = vcd_read(path, [&](uint64_t t, const std::string &name, char value) {
+        if (name == sim_signal_names[SIM_MCLR])
+            pic.edge(t, PIC_MCLR, value != '0');
+        else if (value != 'z' && value != 'x' && name == sim_signal_names[SIM_CLK])
+            pic.edge(t, PIC_CLK, value == '1');
+        else if (value != 'z' && value != 'x' && name == sim_signal_names[SIM_DAT])
+            pic.edge(t, PIC_DAT, value == '1');
+    });
+    if (err)
+    {
+        fprintf(stderr, "icsptrace: can't read %s\n", path);
+        return 2;
+    }
+    return report(pic);
+}
+
+static void
+usage (void)
+{
+    fprintf(stderr,
+        "usage: icsptrace [-f family] [-t ckh,ckl,dly] [-i session.bin] [-r replies.bin]\n"
+        "                 [-o trace.vcd]\n"
+        "       icsptrace [-f family] -c trace.vcd\n"
+        "       icsptrace -l\n");
+}
+
+int
+main (int argc, char **argv)
+{
+    const char *family_name = pic_families[0].name;
+    const char *session_path = NULL;
+    const char *replies_path = NULL;
+    const char *trace_path = NULL;
+    const char *check_path = NULL;
+    const char *timing = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:t:i:r:o:c:lh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'f': family_name = optarg; break;
+        case 't': timing = optarg; break;
+        case 'i': session_path = optarg; break;
+        case 'r': replies_path = optarg; break;
+        case 'o': trace_path = optarg; break;
+        case 'c': check_path = optarg; break;
+        case 'l':
+            for (const pic_family *f = pic_families; f->name; f++)
+            {
+                printf("%s\n", f->name);
+            }
+            return 0;
+        default:
+            usage();
+            return 2;
+        }
+    }
+
+    const pic_family *family = pic_family_find(family_name);
+    if (!family)
+    {
+        fprintf(stderr, "icsptrace: unknown family %s (see -l)\n", family_name);
+        return 2;
+    }
+
+    if (check_path)
+        return check_trace(*family, check_path);
+
+    std::vector<uint8_t> session;
+    if (session_path)
+    {
+        if (read_file(session_path, session))
+        {
+            fprintf(stderr, "icsptrace: can't read %s\n", session_path);
+            return 2;
+        }
+    }
+    else
+    {
+        session = default_session();
+    }
+
+    pic_target pic(*family);
+    vcd_writer *trace = trace_path ? new vcd_writer(trace_path, sim_signal_names, SIM_SIGNALS) : NULL;
+    script_host host(session);
+
+    sim_attach(&pic, trace);
+    sim_uart_attach(&host);
+
+    uuart_init();
+    icsp_init();
+
+    if (timing)
+    {
+        unsigned int ckh, ckl, dly;
+        if (sscanf(timing, "%u,%u,%u", &ckh, &ckl, &dly) != 3)
+        {
+            usage();
+            return 2;
+        }
+        icsp_timing.ckh = ckh;
+        icsp_timing.ckl = ckl;
+        icsp_timing.dly = dly;
+    }
+
+    try
+    {
+        for (;;)
+        {
+            handle_command();
+        }
+    }
+    catch (const sim_uart_eof &)
+    {
+    }
+
+    printf("session: %zu bytes in, %zu bytes out, %.3f ms\n",
+           session.size(), host.replies.size(), sim_now_ns() / 1e6);
+
+    if (replies_path && write_file(replies_path, host.replies))
+    {
+        fprintf(stderr, "icsptrace: can't write %s\n", replies_path);
+        return 2;
+    }
+
+    if (trace && trace->close())
+    {
+        fprintf(stderr, "icsptrace: can't write %s\n", trace_path);
+        return 2;
+    }
+    delete trace;
+
+    return report(pic);
+}
@@ -0,0 +1,348 @@
+/** @file pic.cpp
+ *
+ * A model of a PIC in low voltage ICSP programming mode.
+ *
+*/
+
+#include <string.h>
+
+#include "pic.h"
+
+#include "icsp.h"
+
+
+#define PIC_CONFIG_BASE     0x8000
+#define PIC_CONFIG_WORDS    0x100
+#define PIC_WORD_MASK       0x3FFF
+
+// Timing minima from each family's programming specification.
+const pic_family pic_families[] = {
+//    name           flash   row  TENTH   CKH  CKL  DS  DH  DLY   ERAB     ERAR     PINT_PM  PINT_CW
+    { "pic16f18xxx", 0x8000, 32,  250000, 100, 100, 50, 30, 1000, 8400000, 2800000, 2800000, 5600000 },
+    { "pic16f152xx", 0x4000, 32,  250000, 100, 100, 50, 30, 1000, 8400000, 2800000, 2800000, 5600000 },
+    { NULL,          0,      0,   0,      0,   0,   0,  0,  0,    0,       0,       0,       0 },
+};
+
+const pic_family *
+pic_family_find (const char *name)
+{
+    for (const pic_family *f = pic_families; f->name; f++)
+    {
+        if (strcmp(f->name, name) == 0)
+        {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+
+pic_target::pic_target (const pic_family &family)
+    : family(family),
+      flash(family.flash_words, PIC_WORD_MASK),
+      config(PIC_CONFIG_WORDS, PIC_WORD_MASK),
+      latches(family.row_words, PIC_WORD_MASK)
+{
+}
+
+uint16_t
+pic_target::read (uint16_t address) const
+{
+    if (address < flash.size())
+    {
+        return flash[address];
+    }
+    if (address >= PIC_CONFIG_BASE && (size_t)(address - PIC_CONFIG_BASE) < config.size())
+    {
+        return config[address - PIC_CONFIG_BASE];
+    }
+    // Unimplemented locations read as 0
+    return 0;
+}
+
+void
+pic_target::write (uint16_t address, uint16_t word)
+{
+    if (address < flash.size())
+    {
+        flash[address] = word & PIC_WORD_MASK;
+    }
+    else if (address >= PIC_CONFIG_BASE && (size_t)(address - PIC_CONFIG_BASE) < config.size())
+    {
+        config[address - PIC_CONFIG_BASE] = word & PIC_WORD_MASK;
+    }
+}
+
+
+void
+pic_target::edge (uint64_t t, pic_signal signal, int level)
+{
+    edges++;
+
+    switch (signal)
+    {
+    case PIC_MCLR:
+        if (level == mclr)
+            return;
+        mclr = level;
+        if (!level)
+        {
+            // Entering programming mode, wait for the key.
+            st = KEY;
+            shift = 0;
+            bits = 0;
+            clocked = false;
+            dly_pending = false;
+            garbled = 0;
+            latches.assign(latches.size(), PIC_WORD_MASK);
+            t_mclr_low = t;
+        }
+        else
+        {
+            if (st != OFF)
+                check_busy(t, "MCLR rising");
+            st = OFF;
+            dat_drive = -1;
+        }
+        break;
+
+    case PIC_CLK:
+        if (level == clk)
+            return;
+        clk = level;
+        if (level)
+            clk_rise(t);
+        else
+            clk_fall(t);
+        break;
+
+    case PIC_DAT:
+        if (level == dat)
+            return;
+        dat = level;
+        dat_change(t);
+        break;
+    }
+}
+
+void
+pic_target::check (uint64_t t, const char *edge, const char *rule,
+                   uint64_t since, uint64_t required)
+{
+    if (t - since < required)
+    {
+        violations.push_back({t, edge, rule, required, t - since});
+        garbled = 1;
+    }
+}
+
+void
+pic_target::busy (uint64_t t, uint64_t length, const char *rule)
+{
+    busy_start = t;
+    busy_until = t + length;
+    busy_rule = rule;
+}
+
+void
+pic_target::check_busy (uint64_t t, const char *edge)
+{
+    // Report an early edge once per erase or write, not for every clock.
+    if (t < busy_until)
+    {
+        check(t, edge, busy_rule, busy_start, busy_until - busy_start);
+        busy_until = 0;
+    }
+}
+
+void
+pic_target::clk_rise (uint64_t t)
+{
+    if (st == OFF)
+        return;
+
+    check_busy(t, "CLK rising");
+
+    if (!clocked)
+        check(t, "CLK rising", "TENTH", t_mclr_low, family.tenth);
+    else
+        check(t, "CLK rising", "TCKL", t_clk_fall, family.tckl);
+
+    if (dly_pending)
+    {
+        check(t, "CLK rising", "TDLY", t_dly, family.tdly);
+        dly_pending = false;
+    }
+
+    clocked = true;
+    t_clk_rise = t;
+
+    // Reads are shifted out MSb first on the rising edge.
+    if (st == PAYLOAD_OUT)
+    {
+        dat_drive = ((out >> (23 - bits)) & 1) ^ garbled;
+        garbled = 0;
+    }
+}
+
+void
+pic_target::clk_fall (uint64_t t)
+{
+    if (st == OFF)
+        return;
+
+    check(t, "CLK falling", "TCKH", t_clk_rise, family.tckh);
+    t_clk_fall = t;
+
+    if (st == PAYLOAD_OUT)
+    {
+        if (++bits == 24)
+        {
+            dat_drive = -1;
+            if (cmd == ICSP_CMD_READ_DATA_INC)
+                pc++;
+            st = COMMAND;
+            bits = 0;
+            t_dly = t;
+            dly_pending = true;
+        }
+        return;
+    }
+
+    // Data is latched on the falling edge.
+    check(t, "CLK falling", "TDS", t_dat, family.tds);
+    shift = (shift << 1) | (dat ^ garbled);
+    garbled = 0;
+    bits++;
+
+    if (st == KEY && bits == 32)
+    {
+        const char *key = ICSP_STARTUP_KEY;
+        uint32_t expected = ((uint32_t)key[0] << 24) | ((uint32_t)key[1] << 16) |
+                            ((uint32_t)key[2] << 8) | (uint32_t)key[3];
+        if (shift != expected)
+        {
+            violations.push_back({t, "CLK falling", "entry key", 0, 0});
+            st = OFF;
+        }
+        else
+        {
+            st = COMMAND;
+        }
+        bits = 0;
+        shift = 0;
+    }
+    else if (st == COMMAND && bits == 8)
+    {
+        bits = 0;
+        command(t, shift & 0xFF);
+        shift = 0;
+    }
+    else if (st == PAYLOAD_IN && bits == 24)
+    {
+        // Start bit, 16 data bits and a stop bit.
+        payload((shift >> 1) & 0xFFFF);
+        st = COMMAND;
+        bits = 0;
+        shift = 0;
+        t_dly = t;
+        dly_pending = true;
+    }
+}
+
+void
+pic_target::dat_change (uint64_t t)
+{
+    t_dat = t;
+
+    if (st == OFF || st == PAYLOAD_OUT)
+        return;
+
+    if (clocked && !clk)
+        check(t, "DAT change", "TDH", t_clk_fall, family.tdh);
+}
+
+void
+pic_target::command (uint64_t t, uint8_t c)
+{
+    cmd = c;
+    t_dly = t;
+    dly_pending = true;
+
+    switch (c)
+    {
+    case ICSP_CMD_ADDR_LOAD:
+    case ICSP_CMD_LOAD_DATA:
+    case ICSP_CMD_LOAD_DATA_INC:
+        st = PAYLOAD_IN;
+        break;
+
+    case ICSP_CMD_READ_DATA:
+    case ICSP_CMD_READ_DATA_INC:
+        st = PAYLOAD_OUT;
+        out = (uint32_t)read(pc) << 1;
+        break;
+
+    case ICSP_CMD_ADDR_INC:
+        pc++;
+        break;
+
+    case ICSP_CMD_START_INT:
+    case ICSP_CMD_START_EXT:
+        // Programming can only clear bits. Program memory is written a
+        // whole row at a time, the row the PC is in, configuration words
+        // one at a time. Latches that weren't loaded are blank.
+        if (pc >= PIC_CONFIG_BASE)
+        {
+            write(pc, read(pc) & latches[pc & (family.row_words - 1)]);
+            busy(t, family.tpint_cw, "TPINT_CW");
+        }
+        else
+        {
+            uint32_t base = pc & ~(family.row_words - 1);
+            for (uint32_t i = 0; i < family.row_words; i++)
+            {
+                write(base + i, read(base + i) & latches[i]);
+            }
+            busy(t, family.tpint_pm, "TPINT_PM");
+        }
+        latches.assign(latches.size(), PIC_WORD_MASK);
+        break;
+
+    case ICSP_CMD_ERASE_ROW:
+        if (pc < flash.size())
+        {
+            uint32_t base = pc & ~(family.row_words - 1);
+            for (uint32_t i = 0; i < family.row_words && base + i < flash.size(); i++)
+            {
+                flash[base + i] = PIC_WORD_MASK;
+            }
+        }
+        busy(t, family.terar, "TERAR");
+        break;
+
+    case ICSP_CMD_ERASE_BULK:
+        flash.assign(flash.size(), PIC_WORD_MASK);
+        if (pc >= PIC_CONFIG_BASE)
+            config.assign(config.size(), PIC_WORD_MASK);
+        busy(t, family.terab, "TERAB");
+        break;
+
+    default:
+        break;
+    }
+}
+
+void
+pic_target::payload (uint16_t data)
+{
+    if (cmd == ICSP_CMD_ADDR_LOAD)
+    {
+        pc = data;
+        return;
+    }
+
+    latches[pc & (family.row_words - 1)] = data & PIC_WORD_MASK;
+    if (cmd == ICSP_CMD_LOAD_DATA_INC)
+        pc++;
+}
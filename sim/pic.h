@@ -0,0 +1,114 @@
+/** @file pic.h
+ *
+ * A model of a PIC in low voltage ICSP programming mode. It decodes the
+ * MCLR/CLK/DAT transitions it is fed, keeps an in-memory copy of the
+ * program and configuration memory, drives DAT for reads, and checks every
+ * edge against the timing minima of the selected PIC family. An edge that
+ * breaks one corrupts the bit it clocks, so a profile that is too fast
+ * fails like it would on a part.
+ *
+*/
+
+#ifndef _pic_h_
+#define _pic_h_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+/** Timing minima and memory layout of a PIC family, times in nanoseconds. */
+struct pic_family
+{
+    const char *name;
+    uint32_t    flash_words;
+    uint32_t    row_words;
+    uint32_t    tenth;      // MCLR low to first clock
+    uint32_t    tckh;       // Clock high
+    uint32_t    tckl;       // Clock low
+    uint32_t    tds;        // Data setup before clock falling edge
+    uint32_t    tdh;        // Data hold after clock falling edge
+    uint32_t    tdly;       // Command/payload to next clock
+    uint32_t    terab;      // Bulk erase
+    uint32_t    terar;      // Row erase
+    uint32_t    tpint_pm;   // Program memory internally timed write
+    uint32_t    tpint_cw;   // Configuration word internally timed write
+};
+
+/** Look up a family by name, NULL if it isn't in the table. */
+const pic_family *  pic_family_find (const char *name);
+
+/** The families known to the simulator, terminated by a NULL name. */
+extern const pic_family pic_families[];
+
+/** A timing rule broken by an edge. */
+struct pic_violation
+{
+    uint64_t    time_ns;
+    std::string edge;
+    std::string rule;
+    uint64_t    required_ns;
+    uint64_t    actual_ns;
+};
+
+enum pic_signal { PIC_MCLR, PIC_CLK, PIC_DAT };
+
+class pic_target
+{
+public:
+    explicit pic_target (const pic_family &family);
+
+    /** Feed a line level change seen on the bus. */
+    void        edge (uint64_t time_ns, pic_signal signal, int level);
+
+    /** What the PIC drives onto DAT: 0, 1 or -1 when it is not driving. */
+    int         dat_out (void) const { return dat_drive; }
+
+    /** Program memory and configuration words. */
+    uint16_t    read (uint16_t address) const;
+    void        write (uint16_t address, uint16_t word);
+
+    const pic_family &family;
+    std::vector<pic_violation> violations;
+    uint64_t    edges = 0;
+
+private:
+    enum state { OFF, KEY, COMMAND, PAYLOAD_IN, PAYLOAD_OUT };
+
+    void        clk_rise (uint64_t t);
+    void        clk_fall (uint64_t t);
+    void        dat_change (uint64_t t);
+    void        command (uint64_t t, uint8_t cmd);
+    void        payload (uint16_t data);
+    void        check (uint64_t t, const char *edge, const char *rule,
+                       uint64_t since, uint64_t required);
+    void        busy (uint64_t t, uint64_t length, const char *rule);
+    void        check_busy (uint64_t t, const char *edge);
+
+    state       st = OFF;
+    int         mclr = 1, clk = 0, dat = 0;
+    int         dat_drive = -1;
+    uint32_t    shift = 0;
+    int         bits = 0;
+    uint8_t     cmd = 0;
+    uint16_t    pc = 0;
+    uint32_t    out = 0;
+
+    uint64_t    t_mclr_low = 0;
+    uint64_t    t_clk_rise = 0;
+    uint64_t    t_clk_fall = 0;
+    uint64_t    t_dat = 0;
+    uint64_t    t_dly = 0;
+    bool        dly_pending = false;
+    bool        clocked = false;
+    int         garbled = 0;    // The next bit clocked is inverted
+    uint64_t    busy_start = 0;
+    uint64_t    busy_until = 0;
+    const char *busy_rule = "";
+
+    std::vector<uint16_t>           flash;
+    std::vector<uint16_t>           config;
+    std::vector<uint16_t>           latches;   // One row, indexed by the low PC bits
+};
+
+#endif
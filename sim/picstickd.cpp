@@ -0,0 +1,504 @@
+/** @file picstickd.cpp
+ *
+ * picstickd - A virtual picstick on a pseudo-terminal. The firmware's own
+ * command handling runs against the simulated PIC, so host tools see exactly
+ * the protocol of the real stick, paced in real time by a wire model:
+ *
+ *   - the UART baud rate (-b),
+ *   - the USB latency of the CH340 bridge, each way (-u),
+ *   - extra device processing time per command (-p), on top of the ICSP
+ *     timing the simulation already accounts for,
+ *   - the firmware's small receive buffer, which drops bytes sent while the
+ *     stick is busy,
+ *   - bit errors on the line to the stick, one flipped bit in about every
+ *     n bytes (-e).
+ *
+ * -s stretches the family's clock, data and delay minima to a percentage,
+ * a slower part or longer leads, for CALIBRATE to find.
+ *
+ *   picstickd [-f family] [-s percent] [-b baud] [-u usb_latency_us]
+ *             [-p command_us] [-e error_bytes] [-l link] [-d flash.bin]
+ *             [-o trace.vcd]
+ *
+ * The pseudo-terminal's path is printed on startup, -l also symlinks it to
+ * a fixed name. On SIGINT/SIGTERM the timing check results are printed, and
+ * -d writes the program memory out as big endian words.
+ *
+*/
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include "sim.h"
+#include "sim_uart.h"
+#include "pic.h"
+#include "vcd.h"
+
+#include "uuart.h"
+#include "icsp.h"
+#include "commands.h"
+
+
+#define PICSTICKD_USB_LATENCY_US    1000
+
+// The firmware's receive ring keeps one slot free.
+#define PICSTICKD_RX_RING           (UART_RX_BUFFER_SIZE - 1)
+
+
+static volatile sig_atomic_t stop;
+
+static void
+on_signal (int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+
+/** The host end of the UART, on the master side of a pseudo-terminal.
+ *  Virtual time is kept in step with the wall clock, so the stick never
+ *  answers sooner than the real one would. */
+class pty_host : public sim_uart_host
+{
+public:
+    pty_host (int fd, uint64_t latency_ns, unsigned error_bytes)
+        : fd(fd), latency_ns(latency_ns), error_bytes(error_bytes)
+    {
+        start_ns = monotonic_ns();
+    }
+
+    bool rx (uint8_t &byte, uint64_t &arrival_ns) override
+    {
+        // Let the wall clock catch up with whatever the stick was doing.
+        wait_until(sim_now_ns());
+
+        while (ring.empty() && in.empty())
+        {
+            if (stop)
+                return false;
+            pump(out.empty() ? -1 : (int64_t)(out.front().first - wall_ns()));
+        }
+
+        // Processing time starts once the command starts coming in, bytes
+        // keep arriving meanwhile.
+        if (charge_ns)
+        {
+            uint64_t start = ring.empty() ? in.front().first : sim_now_ns();
+            if (start < sim_now_ns())
+                start = sim_now_ns();
+            sim_advance_ns(start + charge_ns - sim_now_ns());
+            charge_ns = 0;
+        }
+
+        settle(sim_now_ns());
+
+        std::pair<uint64_t, uint8_t> next;
+        if (!ring.empty())
+        {
+            next = ring.front();
+            ring.pop_front();
+        }
+        else
+        {
+            next = in.front();
+            in.pop_front();
+        }
+        arrival_ns = next.first;
+        byte = next.second;
+        bytes_in++;
+        return true;
+    }
+
+    bool rx_available (void) override
+    {
+        // The stick keeps running while it looks for input, but only up to
+        // the next byte, it would have seen that as soon as it came in.
+        // handle_idle() polls here between every READ, jumping to the wall
+        // clock while the simulator lags it would let bytes overrun the ring.
+        pump(0);
+        settle(sim_now_ns());
+        if (!ring.empty())
+            return true;
+
+        uint64_t now = wall_ns();
+        if (!in.empty() && in.front().first < now)
+            now = in.front().first;
+        if (now > sim_now_ns())
+            sim_advance_ns(now - sim_now_ns());
+
+        settle(sim_now_ns());
+        return !ring.empty();
+    }
+
+    bool rx_wait (uint64_t deadline_ns) override
+    {
+        wait_until(sim_now_ns());
+        for (;;)
+        {
+            settle(sim_now_ns());
+            if (!ring.empty() || stop)
+                return true;
+            if (!in.empty())
+            {
+                // The stick keeps waiting until the byte is in.
+                uint64_t arrival = in.front().first;
+                if (arrival > deadline_ns)
+                    break;
+                if (arrival > sim_now_ns())
+                    sim_advance_ns(arrival - sim_now_ns());
+                settle(sim_now_ns());
+                return true;
+            }
+
+            uint64_t now = wall_ns();
+            if (now >= deadline_ns)
+                break;
+            pump((int64_t)(deadline_ns - now));
+        }
+
+        if (deadline_ns > sim_now_ns())
+            sim_advance_ns(deadline_ns - sim_now_ns());
+        settle(sim_now_ns());
+        return false;
+    }
+
+    void rx_flush (void) override
+    {
+        settle(sim_now_ns());
+        ring.clear();
+    }
+
+    void tx (uint8_t byte, uint64_t done_ns) override
+    {
+        out.push_back({done_ns + latency_ns, byte});
+        bytes_out++;
+    }
+
+    /** Hold back the next byte received by some processing time. */
+    void charge (uint64_t ns)
+    {
+        charge_ns = ns;
+    }
+
+    /** Write out everything still queued, at the time it is due. */
+    void drain (void)
+    {
+        while (!out.empty())
+        {
+            pump((int64_t)(out.front().first - wall_ns()));
+        }
+    }
+
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    uint64_t bytes_dropped = 0;
+    uint64_t bytes_damaged = 0;
+
+private:
+    static uint64_t monotonic_ns (void)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    uint64_t wall_ns (void)
+    {
+        return monotonic_ns() - start_ns;
+    }
+
+    /** Move bytes that have arrived by time t into the stick's receive
+     *  buffer. It only empties when the firmware reads it, so anything that
+     *  arrives while it is full is lost, like on the real stick. */
+    void settle (uint64_t t)
+    {
+        while (!in.empty() && in.front().first <= t)
+        {
+            if (ring.size() < PICSTICKD_RX_RING)
+                ring.push_back(in.front());
+            else
+                bytes_dropped++;
+            in.pop_front();
+        }
+    }
+
+    void wait_until (uint64_t t)
+    {
+        uint64_t now;
+        while ((now = wall_ns()) < t && !stop)
+        {
+            pump((int64_t)(t - now));
+        }
+    }
+
+    /** Send what is due, then wait up to timeout_ns (or forever if
+     *  negative) for bytes from the host. */
+    void pump (int64_t timeout_ns)
+    {
+        flush();
+
+        if (!out.empty())
+        {
+            // Never negative, that would mean waiting forever.
+            int64_t due = (int64_t)(out.front().first - wall_ns());
+            if (due < 0)
+                due = 0;
+            if (timeout_ns < 0 || due < timeout_ns)
+                timeout_ns = due;
+        }
+        if (timeout_ns < 0 && stop)
+            return;
+
+        struct pollfd pfd = {fd, POLLIN, 0};
+        struct timespec ts;
+        struct timespec *tp = NULL;
+        if (timeout_ns >= 0)
+        {
+            ts.tv_sec = timeout_ns / 1000000000LL;
+            ts.tv_nsec = timeout_ns % 1000000000LL;
+            tp = &ts;
+        }
+
+        if (ppoll(&pfd, 1, tp, NULL) > 0 && (pfd.revents & POLLIN))
+        {
+            // Bytes reach the UART one USB latency after they were written,
+            // then go out one frame after another.
+            uint8_t buf[256];
+            ssize_t n = read(fd, buf, sizeof(buf));
+            uint64_t now = wall_ns() + latency_ns;
+            for (ssize_t i = 0; i < n; i++)
+            {
+                wire_free = ((wire_free > now) ? wire_free : now) + SIM_UART_FRAME_NS;
+                if (error_bytes && rand() % error_bytes == 0)
+                {
+                    buf[i] ^= 1 << (rand() % 8);
+                    bytes_damaged++;
+                }
+                in.push_back({wire_free, buf[i]});
+            }
+        }
+
+        flush();
+    }
+
+    void flush (void)
+    {
+        uint8_t buf[256];
+        size_t n = 0;
+        uint64_t now = wall_ns();
+
+        while (!out.empty() && out.front().first <= now && n < sizeof(buf))
+        {
+            buf[n++] = out.front().second;
+            out.pop_front();
+        }
+        if (n && write(fd, buf, n) < 0)
+        {
+            perror("picstickd: write");
+        }
+    }
+
+    int         fd;
+    uint64_t    latency_ns;
+    unsigned    error_bytes;
+    uint64_t    start_ns;
+    uint64_t    charge_ns = 0;
+    uint64_t    wire_free = 0;
+    std::deque<std::pair<uint64_t, uint8_t>> in;    // On the wire
+    std::deque<std::pair<uint64_t, uint8_t>> ring;  // In the stick's buffer
+    std::deque<std::pair<uint64_t, uint8_t>> out;
+};
+
+
+static int
+open_pty (const char *link, int *keep_fd)
+{
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0 || grantpt(fd) || unlockpt(fd))
+    {
+        perror("picstickd: posix_openpt");
+        return -1;
+    }
+
+    const char *name = ptsname(fd);
+
+    // Hold the slave open ourselves, so the master doesn't see a hangup
+    // every time the host tool closes the port.
+    *keep_fd = open(name, O_RDWR | O_NOCTTY);
+    if (*keep_fd < 0)
+    {
+        perror("picstickd: open slave");
+        return -1;
+    }
+
+    struct termios tio;
+    tcgetattr(*keep_fd, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(*keep_fd, TCSANOW, &tio);
+
+    printf("%s\n", name);
+    if (link)
+    {
+        unlink(link);
+        if (symlink(name, link))
+        {
+            perror("picstickd: symlink");
+            return -1;
+        }
+        printf("%s -> %s\n", link, name);
+    }
+    fflush(stdout);
+
+    return fd;
+}
+
+static int
+dump_flash (const char *path, const pic_target &pic)
+{
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        return -1;
+    for (uint32_t a = 0; a < pic.family.flash_words; a++)
+    {
+        uint16_t word = pic.read(a);
+        fputc(word >> 8, f);
+        fputc(word & 0xFF, f);
+    }
+    return fclose(f);
+}
+
+static void
+usage (void)
+{
+    fprintf(stderr,
+        "usage: picstickd [-f family] [-s percent] [-b baud] [-u usb_latency_us]\n"
+        "                 [-p command_us] [-e error_bytes] [-l link] [-d flash.bin]\n"
+        "                 [-o trace.vcd]\n");
+}
+
+int
+main (int argc, char **argv)
+{
+    const char *family_name = pic_families[0].name;
+    const char *link = NULL;
+    const char *dump_path = NULL;
+    const char *trace_path = NULL;
+    uint64_t latency_us = PICSTICKD_USB_LATENCY_US;
+    uint64_t command_us = 0;
+    unsigned error_bytes = 0;
+    unsigned stretch = 100;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:s:b:u:p:e:l:d:o:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'f': family_name = optarg; break;
+        case 's': stretch = strtoul(optarg, NULL, 10); break;
+        case 'b': sim_uart_baud = strtoul(optarg, NULL, 10); break;
+        case 'u': latency_us = strtoull(optarg, NULL, 10); break;
+        case 'p': command_us = strtoull(optarg, NULL, 10); break;
+        case 'e': error_bytes = strtoul(optarg, NULL, 10); break;
+        case 'l': link = optarg; break;
+        case 'd': dump_path = optarg; break;
+        case 'o': trace_path = optarg; break;
+        default:
+            usage();
+            return 2;
+        }
+    }
+
+    const pic_family *family = pic_family_find(family_name);
+    if (!family || sim_uart_baud == 0 || stretch == 0)
+    {
+        usage();
+        return 2;
+    }
+
+    pic_family stretched = *family;
+    stretched.tckh = (uint64_t)family->tckh * stretch / 100;
+    stretched.tckl = (uint64_t)family->tckl * stretch / 100;
+    stretched.tds = (uint64_t)family->tds * stretch / 100;
+    stretched.tdh = (uint64_t)family->tdh * stretch / 100;
+    stretched.tdly = (uint64_t)family->tdly * stretch / 100;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    int keep_fd;
+    int fd = open_pty(link, &keep_fd);
+    if (fd < 0)
+        return 1;
+
+    pic_target pic(stretched);
+    vcd_writer *trace = trace_path ? new vcd_writer(trace_path, sim_signal_names, SIM_SIGNALS) : NULL;
+    pty_host host(fd, latency_us * 1000, error_bytes);
+
+    sim_attach(&pic, trace);
+    sim_uart_attach(&host);
+
+    uuart_init();
+    icsp_init();
+
+    uint64_t commands = 0;
+    try
+    {
+        while (!stop)
+        {
+            // Like the firmware's main loop, do background work until
+            // a command comes in.
+            while (!stop && !uuart_rx_data_available() && handle_idle())
+            {
+            }
+            // And then sleep until one does, only then does the firmware
+            // start on it.
+            host.rx_wait(UINT64_MAX);
+            host.charge(command_us * 1000);
+            handle_command();
+            commands++;
+        }
+    }
+    catch (const sim_uart_eof &)
+    {
+    }
+    host.drain();
+
+    fprintf(stderr, "picstickd: %llu commands, %llu bytes in, %llu bytes out, %llu bytes dropped, %llu damaged\n",
+            (unsigned long long)commands, (unsigned long long)host.bytes_in,
+            (unsigned long long)host.bytes_out, (unsigned long long)host.bytes_dropped,
+            (unsigned long long)host.bytes_damaged);
+    for (const pic_violation &v : pic.violations)
+    {
+        fprintf(stderr, "%14.3f us  %-12s %-10s\n", v.time_ns / 1000.0, v.edge.c_str(), v.rule.c_str());
+    }
+    fprintf(stderr, "picstickd: %zu timing violations\n", pic.violations.size());
+
+    if (dump_path && dump_flash(dump_path, pic))
+        fprintf(stderr, "picstickd: can't write %s\n", dump_path);
+    if (trace && trace->close())
+        fprintf(stderr, "picstickd: can't write %s\n", trace_path);
+    delete trace;
+    if (link)
+        unlink(link);
+
+    close(keep_fd);
+    close(fd);
+    return 0;
+}
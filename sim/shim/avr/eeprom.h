@@ -0,0 +1,21 @@
+/** @file avr/eeprom.h
+ *
+ * Simulator stand-in. EEMEM variables are ordinary variables, which start
+ * out zeroed like an EEPROM that has never been written by the firmware.
+ *
+*/
+
+#ifndef _sim_avr_eeprom_h_
+#define _sim_avr_eeprom_h_
+
+#include <stdint.h>
+#include <string.h>
+
+#define EEMEM
+
+static inline uint8_t eeprom_read_byte (const uint8_t *p) { return *p; }
+static inline void eeprom_update_byte (uint8_t *p, uint8_t v) { *p = v; }
+static inline void eeprom_read_block (void *dst, const void *src, size_t n) { memcpy(dst, src, n); }
+static inline void eeprom_update_block (const void *src, void *dst, size_t n) { memcpy(dst, src, n); }
+
+#endif
@@ -0,0 +1,14 @@
+/** @file avr/interrupt.h
+ *
+ * Simulator stand-in. There are no interrupts, the simulated UART delivers
+ * bytes synchronously.
+ *
+*/
+
+#ifndef _sim_avr_interrupt_h_
+#define _sim_avr_interrupt_h_
+
+#define sei()
+#define cli()
+
+#endif
@@ -0,0 +1,39 @@
+/** @file avr/io.h
+ *
+ * Simulator stand-in for the AVR register definitions. Only the registers
+ * the ICSP code touches are backed by the simulated bus, the rest are plain
+ * bytes so the firmware compiles unchanged.
+ *
+*/
+
+#ifndef _sim_avr_io_h_
+#define _sim_avr_io_h_
+
+#include <stdint.h>
+
+#include "sim.h"
+
+#define PORTA   sim_porta
+#define DDRA    sim_ddra
+#define PINA    sim_pina
+
+#define PORTB   sim_reg_plain[0]
+#define DDRB    sim_reg_plain[1]
+#define PINB    sim_reg_plain[2]
+#define GIMSK   sim_reg_plain[3]
+#define PCMSK0  sim_reg_plain[4]
+#define GIFR    sim_reg_plain[5]
+#define TCCR1B  sim_reg_plain[6]
+#define TCNT1   sim_tcnt1
+
+#define PA5     5
+#define PA6     6
+#define PCIE0   4
+#define PCIF0   4
+#define PCINT6  6
+#define CS10    0
+#define CS11    1
+
+#define _BV(bit) (1 << (bit))
+
+#endif
@@ -0,0 +1,24 @@
+/** @file avr/pgmspace.h
+ *
+ * Simulator stand-in. There is only the one address space on the host, so
+ * program memory is ordinary memory.
+ *
+*/
+
+#ifndef _sim_avr_pgmspace_h_
+#define _sim_avr_pgmspace_h_
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PGM_P               const char *
+#define PSTR(s)             (s)
+
+#define pgm_read_byte(p)    (*(const uint8_t *)(p))
+#define pgm_read_word(p)    (*(const uint16_t *)(p))
+
+#define memcmp_P            memcmp
+#define strlen_P            strlen
+
+#endif
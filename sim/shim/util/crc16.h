@@ -0,0 +1,25 @@
+/** @file util/crc16.h
+ *
+ * Simulator stand-in, the C equivalent from the avr-libc documentation.
+ *
+*/
+
+#ifndef _sim_util_crc16_h_
+#define _sim_util_crc16_h_
+
+#include <stdint.h>
+
+#include "sim.h"
+
+static inline uint16_t
+_crc_ccitt_update (uint16_t crc, uint8_t data)
+{
+    // About as long as the inline assembly it replaces.
+    sim_advance_cycles(13);
+
+    data ^= crc & 0xFF;
+    data ^= data << 4;
+    return ((((uint16_t)data << 8) | (crc >> 8)) ^ (uint8_t)(data >> 4) ^ ((uint16_t)data << 3));
+}
+
+#endif
@@ -0,0 +1,15 @@
+/** @file util/delay.h
+ *
+ * Simulator stand-in. Delays advance the virtual clock instead of spinning.
+ *
+*/
+
+#ifndef _sim_util_delay_h_
+#define _sim_util_delay_h_
+
+#include "sim.h"
+
+static inline void _delay_us (double us) { sim_advance_ns((uint64_t)(us * 1000)); }
+static inline void _delay_ms (double ms) { sim_advance_ns((uint64_t)(ms * 1000000)); }
+
+#endif
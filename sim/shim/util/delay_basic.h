@@ -0,0 +1,16 @@
+/** @file util/delay_basic.h
+ *
+ * Simulator stand-in. The loops advance the virtual clock by the cycles
+ * they would burn on the AVR.
+ *
+*/
+
+#ifndef _sim_util_delay_basic_h_
+#define _sim_util_delay_basic_h_
+
+#include "sim.h"
+
+static inline void _delay_loop_1 (uint8_t count) { sim_advance_cycles(3 * (count ? count : 256)); }
+static inline void _delay_loop_2 (uint16_t count) { sim_advance_cycles(4 * (count ? count : 65536UL)); }
+
+#endif
@@ -0,0 +1,166 @@
+/** @file sim.cpp
+ *
+ * Virtual clock and ICSP pin model for the host side simulation.
+ *
+*/
+
+#include "sim.h"
+#include "pic.h"
+#include "vcd.h"
+
+#include "icsp.h"
+
+
+const char *sim_signal_names[SIM_SIGNALS] = {
+    "mclr", "clk", "dat", "uart_rx", "uart_tx",
+};
+
+sim_reg     sim_porta;
+sim_reg     sim_ddra;
+sim_pin_reg sim_pina;
+sim_timer_reg sim_tcnt1;
+uint8_t     sim_reg_plain[8];
+
+static uint64_t     now_ns;
+static pic_target  *target;
+static vcd_writer  *trace;
+
+// Last level seen on each ICSP line: '0', '1' or 'z'.
+static char         lines[SIM_UART_RX] = {'z', 'z', 'z'};
+static bool         contention;
+
+
+uint64_t
+sim_now_ns (void)
+{
+    return now_ns;
+}
+
+void
+sim_advance_ns (uint64_t ns)
+{
+    now_ns += ns;
+}
+
+void
+sim_advance_cycles (uint64_t cycles)
+{
+    now_ns += cycles * SIM_NS_PER_CYCLE;
+}
+
+
+static char
+host_level (uint8_t pin)
+{
+    if (!(sim_ddra.value & pin))
+        return 'z';
+    return (sim_porta.value & pin) ? '1' : '0';
+}
+
+static void
+update_lines (void)
+{
+    // A PIC edge can make it drive DAT, so repeat until the lines settle.
+    for (int pass = 0; pass < 4; pass++)
+    {
+        char level[SIM_UART_RX] = {
+            host_level(ICSP_PIN_MCLR),
+            host_level(ICSP_PIN_CLK),
+            host_level(ICSP_PIN_DAT),
+        };
+
+        int pic_dat = target ? target->dat_out() : -1;
+        if (pic_dat >= 0)
+        {
+            if (level[SIM_DAT] != 'z' && !contention && target)
+            {
+                target->violations.push_back({now_ns, "DAT", "contention", 0, 0});
+            }
+            contention = level[SIM_DAT] != 'z';
+            if (!contention)
+                level[SIM_DAT] = '0' + pic_dat;
+        }
+        else
+        {
+            contention = false;
+        }
+
+        bool changed = false;
+        for (int i = 0; i < SIM_UART_RX; i++)
+        {
+            if (level[i] == lines[i])
+                continue;
+            lines[i] = level[i];
+            changed = true;
+
+            if (trace)
+                trace->change(now_ns, i, level[i]);
+
+            // MCLR is pulled up on the target, a floating CLK or DAT is
+            // not an edge.
+            if (target && (level[i] != 'z' || i == SIM_MCLR))
+                target->edge(now_ns, (pic_signal)i, level[i] != '0');
+        }
+        if (!changed)
+            break;
+    }
+}
+
+void
+sim_attach (pic_target *pic, vcd_writer *vcd)
+{
+    target = pic;
+    trace = vcd;
+
+    if (trace)
+    {
+        for (int i = 0; i < SIM_UART_RX; i++)
+        {
+            trace->change(now_ns, i, lines[i]);
+        }
+        trace->change(now_ns, SIM_UART_RX, '1');
+        trace->change(now_ns, SIM_UART_TX, '1');
+    }
+}
+
+void
+sim_uart_line (sim_signal signal, int level, uint64_t time_ns)
+{
+    if (trace)
+        trace->change(time_ns, signal, level ? '1' : '0');
+}
+
+
+void
+sim_reg::set (uint8_t v)
+{
+    value = v;
+    sim_advance_cycles(SIM_CYCLES_REG_WRITE);
+    if (this == &sim_porta || this == &sim_ddra)
+        update_lines();
+}
+
+sim_timer_reg::operator uint16_t () const
+{
+    static const unsigned prescale[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+
+    sim_advance_cycles(SIM_CYCLES_REG_READ);
+    unsigned div = prescale[sim_reg_plain[6] & 0x07];
+    if (div == 0)
+        return 0;
+    return (uint16_t)(now_ns / SIM_NS_PER_CYCLE / div);
+}
+
+sim_pin_reg::operator uint8_t () const
+{
+    sim_advance_cycles(SIM_CYCLES_REG_READ);
+
+    uint8_t pins = 0;
+    if (lines[SIM_MCLR] == '1')
+        pins |= ICSP_PIN_MCLR;
+    if (lines[SIM_CLK] == '1')
+        pins |= ICSP_PIN_CLK;
+    if (lines[SIM_DAT] == '1')
+        pins |= ICSP_PIN_DAT;
+    return pins;
+}
@@ -0,0 +1,87 @@
+/** @file sim.h
+ *
+ * Host side simulation of the picstick. The firmware sources are compiled
+ * unchanged against the stand-in AVR headers in shim/, which route port
+ * accesses and delays through here. A virtual clock advances by the cycles
+ * the AVR would spend on them, and every transition of the ICSP pins is
+ * passed on to the trace and the simulated PIC.
+ *
+ * Only register accesses and delays are charged, not the surrounding code,
+ * so simulated edges are never further apart than on the real hardware.
+ * A sequence that meets the timing minima on the real stick will also meet
+ * them here, but not the other way around.
+ *
+*/
+
+#ifndef _sim_h_
+#define _sim_h_
+
+#include <stdint.h>
+
+#define SIM_NS_PER_CYCLE        (1000000000ULL / F_CPU)
+
+// Cycles charged per I/O register access (sbi/cbi and in).
+#define SIM_CYCLES_REG_WRITE    2
+#define SIM_CYCLES_REG_READ     1
+
+
+class pic_target;
+class vcd_writer;
+
+/** Signals in the trace, in the order they are declared in the VCD. */
+enum sim_signal { SIM_MCLR, SIM_CLK, SIM_DAT, SIM_UART_RX, SIM_UART_TX, SIM_SIGNALS };
+
+extern const char *sim_signal_names[SIM_SIGNALS];
+
+
+/** Current virtual time in nanoseconds. */
+uint64_t    sim_now_ns (void);
+
+/** Advance the virtual clock. */
+void        sim_advance_ns (uint64_t ns);
+void        sim_advance_cycles (uint64_t cycles);
+
+/** Connect the simulated PIC and an optional trace to the ICSP pins. */
+void        sim_attach (pic_target *target, vcd_writer *trace);
+
+/** Record a UART line level at a (possibly future) time in the trace. */
+void        sim_uart_line (sim_signal signal, int level, uint64_t time_ns);
+
+
+/** An I/O register whose writes drive the simulated ICSP pins. */
+class sim_reg
+{
+public:
+    uint8_t value = 0;
+
+    operator uint8_t () const { return value; }
+    sim_reg &operator= (uint8_t v) { set(v); return *this; }
+    sim_reg &operator|= (uint8_t v) { set(value | v); return *this; }
+    sim_reg &operator&= (uint8_t v) { set(value & v); return *this; }
+
+private:
+    void set (uint8_t v);
+};
+
+/** The PIN register, reads sample the simulated ICSP pins. */
+class sim_pin_reg
+{
+public:
+    operator uint8_t () const;
+};
+
+/** Timer1's count, running off the simulated clock at the prescale set in
+ *  TCCR1B. */
+class sim_timer_reg
+{
+public:
+    operator uint16_t () const;
+};
+
+extern sim_reg      sim_porta;
+extern sim_reg      sim_ddra;
+extern sim_pin_reg  sim_pina;
+extern sim_timer_reg sim_tcnt1;
+extern uint8_t      sim_reg_plain[8];
+
+#endif
@@ -0,0 +1,53 @@
+/** @file sim_uart.h
+ *
+ * The host end of the simulated UART. The firmware's uuart functions are
+ * replaced by uuart_sim.cpp, which pulls received bytes from and pushes
+ * transmitted bytes to a sim_uart_host. Transmission is timed on the virtual
+ * clock at the configured baud rate, reception is timed by the host end.
+ *
+*/
+
+#ifndef _sim_uart_h_
+#define _sim_uart_h_
+
+#include <stdint.h>
+
+// Nanoseconds per bit and per 10 bit frame on the wire.
+#define SIM_UART_BIT_NS     (1000000000ULL / sim_uart_baud)
+#define SIM_UART_FRAME_NS   (10 * SIM_UART_BIT_NS)
+
+/** Simulated baud rate, the firmware's BAUDRATE unless changed. */
+extern uint32_t sim_uart_baud;
+
+/** Thrown out of the firmware when the host has nothing more to send. */
+struct sim_uart_eof {};
+
+class sim_uart_host
+{
+public:
+    virtual ~sim_uart_host () {}
+
+    /** Get the next byte sent by the host and the time its stop bit ended
+     *  on the wire, which may be in the past if it was waiting in the
+     *  receive buffer. Returns false at end of input. */
+    virtual bool    rx (uint8_t &byte, uint64_t &arrival_ns) = 0;
+
+    /** Whether a byte from the host is waiting. */
+    virtual bool    rx_available (void) = 0;
+
+    /** Whether a byte from the host is in by deadline_ns, or at end of
+     *  input, for rx() to pick up. If not, the virtual clock is moved on
+     *  to the deadline. */
+    virtual bool    rx_wait (uint64_t deadline_ns) = 0;
+
+    /** Drop the bytes in the firmware's receive buffer, like flushing it. */
+    virtual void    rx_flush (void) = 0;
+
+    /** A byte sent by the firmware, done_ns is when its stop bit ends. */
+    virtual void    tx (uint8_t byte, uint64_t done_ns) = 0;
+};
+
+/** Connect the simulated UART to its host end. */
+void        sim_uart_attach (sim_uart_host *host);
+
+#endif
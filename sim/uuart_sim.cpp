@@ -0,0 +1,175 @@
+/** @file uuart_sim.cpp
+ *
+ * Simulated replacement for uuart.c. Transmitted bytes are framed on the
+ * virtual clock at sim_uart_baud, and both lines are recorded in the trace.
+ *
+*/
+
+#include <stdio.h>
+
+#include "sim.h"
+#include "sim_uart.h"
+
+#include "uuart.h"
+
+
+uint32_t                sim_uart_baud = BAUDRATE;
+
+static sim_uart_host   *host;
+static uint64_t         tx_free;    // When the TX line is next idle
+static bool             rx_timed_out;
+
+
+void
+sim_uart_attach (sim_uart_host *h)
+{
+    host = h;
+}
+
+static void
+frame (sim_signal signal, uint64_t start, unsigned char data)
+{
+    // Start bit, 8 data bits LSb first, stop bit.
+    sim_uart_line(signal, 0, start);
+    for (int bit = 0; bit < 8; bit++)
+    {
+        sim_uart_line(signal, (data >> bit) & 1, start + (bit + 1) * SIM_UART_BIT_NS);
+    }
+    sim_uart_line(signal, 1, start + 9 * SIM_UART_BIT_NS);
+}
+
+
+void uuart_init(void) {
+    uuart_flush_buffers();
+}
+
+void uuart_flush_buffers(void) {
+    rx_timed_out = false;
+    if (host)
+        host->rx_flush();
+}
+
+void uuart_tx_init(void) {
+}
+
+void uuart_tx_byte(unsigned char data) {
+    uint64_t now = sim_now_ns();
+    uint64_t start = (tx_free > now) ? tx_free : now;
+
+    tx_free = start + SIM_UART_FRAME_NS;
+    frame(SIM_UART_TX, start, data);
+    if (host)
+        host->tx(data, tx_free);
+
+    // Wait for free space in the buffer, like the real one does.
+    if (tx_free > now + UART_TX_BUFFER_SIZE * SIM_UART_FRAME_NS)
+        sim_advance_ns(tx_free - now - UART_TX_BUFFER_SIZE * SIM_UART_FRAME_NS);
+}
+
+void
+uuart_tx_bytes (unsigned char *buf, unsigned char len)
+{
+    for (int i = 0; i < len; i++)
+    {
+        uuart_tx_byte(buf[i]);
+    }
+}
+
+unsigned char uuart_rx_byte(void) {
+    uint8_t data;
+    uint64_t arrival;
+
+    // Give up on the byte like the firmware does, UART_RX_TIMEOUT_MS after
+    // the last one.
+    if (rx_timed_out ||
+        (host && !host->rx_wait(sim_now_ns() + UART_RX_TIMEOUT_MS * 1000000ULL)))
+    {
+        rx_timed_out = true;
+        return 0;
+    }
+
+    if (!host || !host->rx(data, arrival))
+        throw sim_uart_eof();
+
+    // Wait for the byte if it isn't in yet.
+    uint64_t now = sim_now_ns();
+    if (arrival > now)
+        sim_advance_ns(arrival - now);
+    frame(SIM_UART_RX, arrival - SIM_UART_FRAME_NS, data);
+
+    return data;
+}
+
+unsigned char
+uuart_rx_bytes (unsigned char *buf, unsigned char len)
+{
+    unsigned char bytes_read = 0;
+
+    while (bytes_read < len)
+    {
+        buf[bytes_read] = uuart_rx_byte();
+        if (rx_timed_out)
+            break;
+        bytes_read++;
+    }
+    return bytes_read;
+}
+
+unsigned char
+uuart_rx_bytes_until (unsigned char sep, unsigned char *buf, unsigned char len)
+{
+    unsigned char bytes_read = 0;
+    unsigned char read_byte;
+
+    while (bytes_read < len)
+    {
+        read_byte = uuart_rx_byte();
+        if (rx_timed_out)
+            return bytes_read;
+        if (read_byte == sep)
+        {
+            return bytes_read;
+        }
+        buf[bytes_read++] = read_byte;
+    }
+
+    return len;
+}
+
+unsigned char uuart_rx_data_available(void) {
+    return host && host->rx_available();
+}
+
+unsigned char uuart_rx_timeout(void) {
+    return rx_timed_out;
+}
+
+void uuart_print(char *str) {
+    uint8_t i = 0;
+    while (str[i]) {
+        uuart_tx_byte(str[i++]);
+    }
+}
+
+void uuart_print_P(const char *str) {
+    uuart_print((char *)str);
+}
+
+void uuart_showbits(int byte) {
+    char buf[17];
+    int i = 16;
+    buf[i] = '\0';
+    do {
+        buf[--i] = '0' + (byte & 1);
+        byte = (unsigned int)byte >> 1;
+    } while (byte && i);
+    uuart_print_P("0b");
+    uuart_print(buf + i);
+}
+
+void uuart_showhex(int byte) {
+    char buf[8];
+    snprintf(buf, sizeof(buf), "%x", byte & 0xFFFF);
+    uuart_print_P("0x");
+    uuart_print(buf);
+}
@@ -0,0 +1,130 @@
+/** @file vcd.cpp
+ *
+ * Value Change Dump traces of single bit signals.
+ *
+*/
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+
+#include "vcd.h"
+
+
+// Identifier codes are printable characters starting at '!'.
+#define VCD_ID(signal)  ((char)('!' + (signal)))
+
+
+vcd_writer::vcd_writer (const char *path, const char *const *names, int count)
+    : path(path), names(names, names + count)
+{
+}
+
+vcd_writer::~vcd_writer ()
+{
+    close();
+}
+
+void
+vcd_writer::change (uint64_t time_ns, int signal, char value)
+{
+    entries.push_back({time_ns, signal, value});
+}
+
+int
+vcd_writer::close (void)
+{
+    if (closed)
+        return 0;
+    closed = true;
+
+    FILE *f = fopen(path.c_str(), "w");
+    if (!f)
+        return -1;
+
+    fprintf(f, "$timescale 1ns $end\n");
+    fprintf(f, "$scope module picstick $end\n");
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        fprintf(f, "$var wire 1 %c %s $end\n", VCD_ID(i), names[i].c_str());
+    }
+    fprintf(f, "$upscope $end\n");
+    fprintf(f, "$enddefinitions $end\n");
+
+    // UART changes are recorded ahead of time, put everything in order
+    // while keeping same time changes in the order they happened.
+    std::stable_sort(entries.begin(), entries.end(),
+                     [](const entry &a, const entry &b) { return a.time_ns < b.time_ns; });
+
+    bool first = true;
+    uint64_t last = 0;
+    for (const entry &e : entries)
+    {
+        if (first || e.time_ns != last)
+        {
+            fprintf(f, "#%llu\n", (unsigned long long)e.time_ns);
+            last = e.time_ns;
+            first = false;
+        }
+        fprintf(f, "%c%c\n", e.value, VCD_ID(e.signal));
+    }
+
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+
+int
+vcd_read (const char *path, const vcd_callback &callback)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+
+    std::map<std::string, std::string> ids;
+    uint64_t mul = 1;
+    uint64_t div = 1;
+    uint64_t now = 0;
+    char line[256];
+    char a[64], b[64], c[64], d[64];
+
+    while (fgets(line, sizeof(line), f))
+    {
+        if (sscanf(line, " $var %63s %63s %63s %63s", a, b, c, d) == 4)
+        {
+            ids[c] = d;
+        }
+        else if (sscanf(line, " $timescale %63s", a) == 1)
+        {
+            // Scale timestamps to nanoseconds.
+            unsigned long n = strtoul(a, NULL, 10);
+            mul = n ? n : 1;
+            div = 1;
+            if (strstr(line, "ps"))
+                div = 1000;
+            else if (strstr(line, "us"))
+                mul *= 1000;
+            else if (strstr(line, "ms"))
+                mul *= 1000000;
+        }
+        else if (line[0] == '#')
+        {
+            now = strtoull(line + 1, NULL, 10) * mul / div;
+        }
+        else if (strchr("01xXzZ", line[0]) && line[0] != '\0')
+        {
+            std::string id(line + 1);
+            id.erase(id.find_last_not_of(" \r\n") + 1);
+            auto name = ids.find(id);
+            if (name != ids.end())
+            {
+                callback(now, name->second, (char)tolower(line[0]));
+            }
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
@@ -0,0 +1,53 @@
+/** @file vcd.h
+ *
+ * Value Change Dump traces of single bit signals, readable by GTKWave and
+ * most logic analyzer software.
+ *
+*/
+
+#ifndef _vcd_h_
+#define _vcd_h_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+/** Collects value changes and writes them out, sorted by time, on close. */
+class vcd_writer
+{
+public:
+    vcd_writer (const char *path, const char *const *names, int count);
+    ~vcd_writer ();
+
+    /** Record a change of signal to '0', '1' or 'z'. */
+    void        change (uint64_t time_ns, int signal, char value);
+
+    /** Write the trace. Returns 0 on success. */
+    int         close (void);
+
+private:
+    struct entry
+    {
+        uint64_t    time_ns;
+        int         signal;
+        char        value;
+    };
+
+    std::string                 path;
+    std::vector<std::string>    names;
+    std::vector<entry>          entries;
+    bool                        closed = false;
+};
+
+/** Callback for every value change read from a trace. */
+typedef std::function<void (uint64_t time_ns, const std::string &name, char value)> vcd_callback;
+
+/** Read a trace of single bit signals, such as one written by vcd_writer.
+ *  The timescale has to be on the same line as its keyword.
+ *  Returns 0 on success. */
+int         vcd_read (const char *path, const vcd_callback &callback);
+
+#endif